@@ -30,6 +30,7 @@ endif
 LIBOPENCM3_MAKE_ARGS = CFLAGS="$(LIBOPENCM3_CFLAGS)" LDFLAGS="$(LIBOPENCM3_LDFLAGS)" AR="$(LIBOPENCM3_AR)"
 
 COMMON_OBJS := $(addprefix $(BUILD_DIR)/,$(addsuffix .o,$(basename $(shell find $(BOOTLOADER_DIR)/src -name "*.c"))))
+BOARD_OBJS := $(addprefix $(BUILD_DIR)/,$(addsuffix .o,$(basename $(wildcard $(BOARD_DIR)/*.c))))
 
 
 ELF := $(BUILD_DIR)/bin/main.elf
@@ -38,7 +39,7 @@ BIN := $(BUILD_DIR)/bin/main.bin
 .PHONY: all
 all: $(LIBOPENCM3_DIR) $(BIN)
 
-$(BUILD_DIR)/bin/%.elf: $(COMMON_OBJS) $(BUILD_DIR)/canard.o
+$(BUILD_DIR)/bin/%.elf: $(COMMON_OBJS) $(BOARD_OBJS) $(BUILD_DIR)/canard.o
 	@echo "### BUILDING $@"
 	@mkdir -p "$(dir $@)"
 	@arm-none-eabi-gcc $(CFLAGS) $(LDFLAGS) $(ARCH_FLAGS) $^ $(LDLIBS) -o $@
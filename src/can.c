@@ -16,8 +16,14 @@
 #include <libopencm3/stm32/can.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/cortex.h>
 #include <can.h>
+#include <init.h>
 #include <timing.h>
+#include <helpers.h>
+#include <string.h>
 
 #undef CAN_BTR_BRP
 #define CAN_BTR_BRP(n) (n)
@@ -28,25 +34,127 @@
 #undef CAN_BTR_SJW
 #define CAN_BTR_SJW(n) ((n) << 24)
 
-static const uint32_t valid_baudrates[] = {
-    125000,
-    250000,
-    500000,
-    1000000
+struct canbus_bit_timing_s {
+    uint32_t baud;
+    uint16_t prescaler;
+    uint8_t bs1;
+    uint8_t bs2;
 };
 
-#define NUM_VALID_BAUDRATES (sizeof(valid_baudrates)/sizeof(valid_baudrates[0]))
+// X(baud, time quanta per bit, BS1 quanta) - the prescaler and BS2 follow from INIT_CLOCK_APB1_FREQUENCY
+#define CANBUS_BIT_TIMINGS(X) \
+    X(20000,   18, 15) \
+    X(50000,   18, 15) \
+    X(83333,   18, 15) \
+    X(100000,  18, 15) \
+    X(125000,  18, 15) \
+    X(250000,  18, 15) \
+    X(500000,  18, 15) \
+    X(800000,  15, 12) \
+    X(1000000,  9,  7)
+
+#define CANBUS_BIT_TIMING_PRESCALER(baud, quanta) ((INIT_CLOCK_APB1_FREQUENCY + (baud)*(quanta)/2) / ((baud)*(quanta)))
+#define CANBUS_BIT_TIMING_ACTUAL_BAUD_X1000(baud, quanta) (1000ULL*INIT_CLOCK_APB1_FREQUENCY / (CANBUS_BIT_TIMING_PRESCALER(baud, quanta)*(quanta)))
+#define CANBUS_BIT_TIMING_SAMPLE_POINT_PER_MILLE(quanta, bs1) (1000 * (1 + (bs1)) / (quanta))
+
+#define CANBUS_BIT_TIMING_ENTRY(baud, quanta, bs1) \
+    { (baud), CANBUS_BIT_TIMING_PRESCALER(baud, quanta), (bs1), (quanta)-1-(bs1) },
+
+// same limits as libcanard's canardSTM32ComputeCANTimings, plus the rate has to come out within 0.5%
+#define CANBUS_BIT_TIMING_CHECK(baud, quanta, bs1) \
+    _Static_assert(CANBUS_BIT_TIMING_PRESCALER(baud, quanta) >= 1 && CANBUS_BIT_TIMING_PRESCALER(baud, quanta) <= 1024, "CAN prescaler out of range for " #baud); \
+    _Static_assert((bs1) >= 1 && (bs1) <= 16 && (quanta)-1-(bs1) >= 1 && (quanta)-1-(bs1) <= 8, "CAN BS1/BS2 out of range for " #baud); \
+    _Static_assert(CANBUS_BIT_TIMING_ACTUAL_BAUD_X1000(baud, quanta) >= 995ULL*(baud) && CANBUS_BIT_TIMING_ACTUAL_BAUD_X1000(baud, quanta) <= 1005ULL*(baud), "CAN bit rate error too large for " #baud); \
+    _Static_assert(CANBUS_BIT_TIMING_SAMPLE_POINT_PER_MILLE(quanta, bs1) < 900 && CANBUS_BIT_TIMING_SAMPLE_POINT_PER_MILLE(quanta, bs1) >= ((baud) >= 1000000 ? 750 : 850), "CAN sample point out of range for " #baud);
+
+CANBUS_BIT_TIMINGS(CANBUS_BIT_TIMING_CHECK)
+
+// ascending, autobaud cycles through it downwards
+static const struct canbus_bit_timing_s bit_timings[] = {
+    CANBUS_BIT_TIMINGS(CANBUS_BIT_TIMING_ENTRY)
+};
+
+#define NUM_VALID_BAUDRATES (sizeof(bit_timings)/sizeof(bit_timings[0]))
+
+// time the edges on the RX pin during autobaud and jump straight to the rate matching the shortest pulse,
+// cycling through the rates is kept as the fallback
+#ifndef BOARD_CONFIG_CAN_AUTOBAUD_PULSE_MEASUREMENT
+#define BOARD_CONFIG_CAN_AUTOBAUD_PULSE_MEASUREMENT 1
+#endif
+
+#define CANBUS_AUTOBAUD_MEASURE_SLICE_US 500
+#define CANBUS_AUTOBAUD_MEASURE_MIN_PULSES 32
+
+// must be a power of two
+#define CANBUS_RX_BUFFER_LEN 64
+#define CANBUS_RX_BUFFER_MASK (CANBUS_RX_BUFFER_LEN-1)
+
+#define COMPILER_BARRIER() __asm__ volatile("" ::: "memory")
+
+#define CANBUS_TX_QUEUE_LEN 12
+// queue entries kept free so that preempted mailbox frames can always be put back
+#define CANBUS_TX_QUEUE_RESERVED CANBUS_NUM_TX_MAILBOXES
+
+// CAN_ESR LEC value software writes back so that the next bus error sets LEC again and raises another interrupt
+#define CANBUS_ESR_LEC_UNUSED (7UL<<4)
+
+// CAN_FiRx bits in 32-bit scale
+#define CANBUS_FILTER_EXT_ID_SHIFT 3
+#define CANBUS_FILTER_IDE (1UL<<2)
+#define CANBUS_FILTER_RTR (1UL<<1)
 
 static uint32_t baudrate = 0;
-static bool successful_recv = false;
+static volatile bool successful_recv = false;
+
+// single-producer (RX ISRs) single-consumer (canbus_recv_message) ring buffer
+static struct canbus_msg rx_buffer[CANBUS_RX_BUFFER_LEN];
+static volatile uint8_t rx_buffer_head;
+static volatile uint8_t rx_buffer_tail;
+static volatile uint32_t rx_overrun_count;
+static volatile uint32_t rx_frame_count;
+static volatile uint32_t rx_byte_count;
+
+// frames waiting for a mailbox, sorted by ascending CAN ID (highest priority first), FIFO among equal IDs
+static struct canbus_msg tx_queue[CANBUS_TX_QUEUE_LEN];
+static volatile uint8_t tx_queue_len;
+
+static struct {
+    bool pending;
+    bool abort_requested;
+    uint32_t load_us;
+    struct canbus_msg msg;
+} tx_mailboxes[CANBUS_NUM_TX_MAILBOXES];
+static struct canbus_tx_mailbox_stats_s tx_mailbox_stats[CANBUS_NUM_TX_MAILBOXES];
+static uint32_t tx_byte_count;
+static uint32_t tx_abort_count;
+static volatile uint32_t bus_off_count;
+static volatile uint32_t error_count;
+
+static struct canbus_filter_s filters[CANBUS_NUM_FILTER_BANKS];
+static uint8_t num_filters;
+static bool initialized;
+
+static void canbus_program_filters(uint8_t prev_num_filters);
+
+static const struct canbus_bit_timing_s* find_bit_timing(uint32_t baud) {
+    for (uint8_t i=0; i<NUM_VALID_BAUDRATES; i++) {
+        if (bit_timings[i].baud == baud) {
+            return &bit_timings[i];
+        }
+    }
+    return NULL;
+}
 
 void canbus_init(uint32_t baud, bool silent, bool auto_retransmit) {
-    if (!canbus_baudrate_valid(baud)) {
+    const struct canbus_bit_timing_s* timing = find_bit_timing(baud);
+    if (!timing) {
         return;
     }
 
+    if (baud != baudrate) {
+        successful_recv = false;
+    }
     baudrate = baud;
-    successful_recv = false;
 
     // Enable peripheral clock
     rcc_periph_clock_enable(RCC_CAN);
@@ -60,53 +168,16 @@ void canbus_init(uint32_t baud, bool silent, bool auto_retransmit) {
     gpio_mode_setup(BOARD_CONFIG_CAN_TX_GPIO_PORT, GPIO_MODE_AF, GPIO_PUPD_NONE, BOARD_CONFIG_CAN_TX_GPIO_PIN);
     gpio_set_af(BOARD_CONFIG_CAN_TX_GPIO_PORT, BOARD_CONFIG_CAN_TX_GPIO_ALTERNATE_FUNCTION, BOARD_CONFIG_CAN_TX_GPIO_PIN);
 
-    // Adapted from libcanard's canardSTM32ComputeCANTimings
-    uint8_t bs1;
-    uint8_t bs2;
-    uint32_t prescaler;
-
-    {
-        const uint8_t max_quanta_per_bit = (baudrate >= 1000000) ? 10 : 17;
-        const uint32_t prescaler_bs = rcc_apb1_frequency / baudrate;
-
-        uint8_t bs1_bs2_sum = (uint8_t)(max_quanta_per_bit - 1);
-
-        // Search for the highest valid prescalar value
-        while ((prescaler_bs % (1 + bs1_bs2_sum)) != 0) {
-            if (bs1_bs2_sum <= 2) {
-                return;
-            }
-            bs1_bs2_sum--;
-        }
-
-        prescaler = prescaler_bs / (1 + bs1_bs2_sum);
-        if (prescaler < 1 || prescaler > 1024) {
-            return;
-        }
-
-        // The recommended sample point location is 87.5% or 7/8. Compute the values of BS1 and BS2 that satisfy BS1+BS2 == bs1_bs2_sum and minimize ((1+BS1)/(1+BS1/BS2) - 7/8)
-        bs1 = ((7 * bs1_bs2_sum - 1) + 4) / 8;
-
-        // Check sample point constraints
-        const uint16_t max_sample_point_per_mille = 900;
-        const uint16_t min_sample_point_per_mille = (baudrate >= 1000000) ? 750 : 850;
-
-        if (1000 * (1 + bs1) / (1 + bs1_bs2_sum) >= max_sample_point_per_mille) {
-            bs1--;
-        }
-
-        if (1000 * (1 + bs1) / (1 + bs1_bs2_sum) < min_sample_point_per_mille) {
-            bs1++;
-        }
-
-        if (1000 * (1 + bs1) / (1 + bs1_bs2_sum) >= max_sample_point_per_mille) {
-            return;
-        }
-
-        bs2 = bs1_bs2_sum-bs1;
-    }
+    nvic_disable_irq(NVIC_USB_LP_CAN1_RX0_IRQ);
+    nvic_disable_irq(NVIC_CAN1_RX1_IRQ);
+    nvic_disable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+    nvic_disable_irq(NVIC_CAN1_SCE_IRQ);
 
     can_reset(CAN1);
+    rx_buffer_tail = rx_buffer_head;
+    tx_queue_len = 0;
+    memset(tx_mailboxes, 0, sizeof(tx_mailboxes));
+
     can_init(
         CAN1,             /* CAN register base address */
         false,            /* TTCM: Time triggered comm mode? */
@@ -114,23 +185,90 @@ void canbus_init(uint32_t baud, bool silent, bool auto_retransmit) {
         false,            /* AWUM: Automatic wakeup mode? */
         !auto_retransmit, /* NART: No automatic retransmission? */
         false,            /* RFLM: Receive FIFO locked mode? */
-        true,             /* TXFP: Transmit FIFO priority? */
+        false,            /* TXFP: Transmit FIFO priority? */
         CAN_BTR_SJW_1TQ,  /* Resynchronization time quanta jump width.*/
-        CAN_BTR_TS1(bs1-1),              /* Time segment 1 time quanta width. */
-        CAN_BTR_TS2(bs2-1),              /* Time segment 2 time quanta width. */
-        prescaler,        /* Baud rate prescaler. */
+        CAN_BTR_TS1(timing->bs1-1),      /* Time segment 1 time quanta width. */
+        CAN_BTR_TS2(timing->bs2-1),      /* Time segment 2 time quanta width. */
+        timing->prescaler, /* Baud rate prescaler. */
         false,            /* Loopback */
         silent             /* Silent */
     );
 
-    can_filter_id_mask_32bit_init(
-        CAN1,  /* CAN register base address */
-        0,     /* Filter ID */
-        0,     /* CAN ID */
-        0,     /* CAN ID mask */
-        0,     /* FIFO assignment (here: FIFO0) */
-        true
-    );
+    canbus_program_filters(0);
+    initialized = true;
+
+    // ABOM recovers from bus-off by itself, the SCE interrupt is only there to count bus-off events and bus errors -
+    // the latter not while listening silently, where autobaud trying the wrong rates would make every frame an error
+    can_enable_irq(CAN1, CAN_IER_FMPIE0 | CAN_IER_FOVIE0 | CAN_IER_FMPIE1 | CAN_IER_FOVIE1 | CAN_IER_TMEIE | CAN_IER_ERRIE | CAN_IER_BOFIE |
+        (silent ? 0 : CAN_IER_LECIE));
+    nvic_enable_irq(NVIC_USB_LP_CAN1_RX0_IRQ);
+    nvic_enable_irq(NVIC_CAN1_RX1_IRQ);
+    nvic_enable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+    nvic_enable_irq(NVIC_CAN1_SCE_IRQ);
+}
+
+// returns CAN1 and its interrupts to their reset state, the pins are left to the caller
+void canbus_deinit(void) {
+    nvic_disable_irq(NVIC_USB_LP_CAN1_RX0_IRQ);
+    nvic_disable_irq(NVIC_CAN1_RX1_IRQ);
+    nvic_disable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+    nvic_disable_irq(NVIC_CAN1_SCE_IRQ);
+
+    rcc_periph_reset_pulse(RST_CAN);
+    rcc_periph_clock_disable(RCC_CAN);
+
+    initialized = false;
+}
+
+// With no filters configured every frame is accepted, which is what autobaud needs.
+// Filters survive canbus_init, so they only have to be set again when the accepted set changes.
+void canbus_set_filters(const struct canbus_filter_s* new_filters, uint8_t new_num_filters) {
+    if (new_num_filters > CANBUS_NUM_FILTER_BANKS) {
+        new_num_filters = CANBUS_NUM_FILTER_BANKS;
+    }
+
+    uint8_t prev_num_filters = num_filters;
+    for (uint8_t i=0; i<new_num_filters; i++) {
+        filters[i] = new_filters[i];
+    }
+    num_filters = new_num_filters;
+
+    if (initialized) {
+        canbus_program_filters(prev_num_filters);
+    }
+}
+
+static void canbus_program_filters(uint8_t prev_num_filters) {
+    if (num_filters == 0) {
+        can_filter_id_mask_32bit_init(
+            CAN1,  /* CAN register base address */
+            0,     /* Filter ID */
+            0,     /* CAN ID */
+            0,     /* CAN ID mask */
+            0,     /* FIFO assignment (here: FIFO0) */
+            true
+        );
+        prev_num_filters = prev_num_filters > 1 ? prev_num_filters : 1;
+        for (uint8_t i=1; i<prev_num_filters; i++) {
+            can_filter_init(CAN1, i, true, false, 0, 0, 0, false);
+        }
+        return;
+    }
+
+    for (uint8_t i=0; i<num_filters; i++) {
+        can_filter_id_mask_32bit_init(
+            CAN1,
+            i,
+            (filters[i].id << CANBUS_FILTER_EXT_ID_SHIFT) | CANBUS_FILTER_IDE,
+            (filters[i].mask << CANBUS_FILTER_EXT_ID_SHIFT) | CANBUS_FILTER_IDE | CANBUS_FILTER_RTR,
+            filters[i].fifo,
+            true
+        );
+    }
+
+    for (uint8_t i=num_filters; i<prev_num_filters; i++) {
+        can_filter_init(CAN1, i, true, false, 0, 0, 0, false);
+    }
 }
 
 uint32_t canbus_get_baudrate(void) {
@@ -153,38 +291,110 @@ void canbus_autobaud_start(struct canbus_autobaud_state_s* state, uint32_t initi
 
     for (uint8_t i=0; i<NUM_VALID_BAUDRATES; i++) {
         state->curr_baud_idx = i;
-        if (valid_baudrates[i] == initial_baud) {
+        if (bit_timings[i].baud == initial_baud) {
             break;
         }
     }
     state->success = false;
+    state->min_pulse_cycles = UINT32_MAX;
+    state->num_pulses = 0;
 
-    canbus_init(valid_baudrates[state->curr_baud_idx], true, false);
+#if BOARD_CONFIG_CAN_AUTOBAUD_PULSE_MEASUREMENT
+    dwt_enable_cycle_counter();
+#endif
+
+    canbus_init(bit_timings[state->curr_baud_idx].baud, true, false);
 }
 
 bool canbus_baudrate_valid(uint32_t baud) {
+    return find_bit_timing(baud) != NULL;
+}
+
+#if BOARD_CONFIG_CAN_AUTOBAUD_PULSE_MEASUREMENT
+// polls the RX pin for one slice, keeping the shortest time between two edges in core clock cycles
+static void autobaud_measure_pulses(struct canbus_autobaud_state_s* state) {
+    // an interrupt taken mid-pulse would stretch one pulse and shorten the next - the slice is shorter than a
+    // systick period, so at most one tick is held back and taken late
+    uint32_t interrupts_masked = cm_mask_interrupts(1);
+
+    const uint32_t slice_cycles = rcc_ahb_frequency/1000000UL*CANBUS_AUTOBAUD_MEASURE_SLICE_US;
+    const uint32_t begin_cycles = DWT_CYCCNT;
+    uint32_t last_edge_cycles = begin_cycles;
+    uint32_t level = GPIO_IDR(BOARD_CONFIG_CAN_RX_GPIO_PORT) & BOARD_CONFIG_CAN_RX_GPIO_PIN;
+    bool seen_edge = false;
+
+    while (true) {
+        uint32_t now_cycles = DWT_CYCCNT;
+        if (now_cycles-begin_cycles >= slice_cycles) {
+            break;
+        }
+
+        uint32_t new_level = GPIO_IDR(BOARD_CONFIG_CAN_RX_GPIO_PORT) & BOARD_CONFIG_CAN_RX_GPIO_PIN;
+        if (new_level == level) {
+            continue;
+        }
+
+        // the first edge of a slice only starts the clock
+        if (seen_edge) {
+            state->min_pulse_cycles = MIN(state->min_pulse_cycles, now_cycles-last_edge_cycles);
+            state->num_pulses++;
+        }
+        seen_edge = true;
+        last_edge_cycles = now_cycles;
+        level = new_level;
+    }
+
+    cm_mask_interrupts(interrupts_masked);
+}
+
+// bit stuffing bounds runs to five bits, so the shortest pulse over a few frames is one bit time -
+// returns the index of the closest rate if it is within 20% of it, or -1
+static int8_t autobaud_baud_idx_from_pulse(uint32_t pulse_cycles) {
+    int8_t best_idx = -1;
+    uint32_t best_err = UINT32_MAX;
     for (uint8_t i=0; i<NUM_VALID_BAUDRATES; i++) {
-        if (valid_baudrates[i] == baud) {
-            return true;
+        uint32_t bit_cycles = rcc_ahb_frequency/bit_timings[i].baud;
+        uint32_t err = pulse_cycles > bit_cycles ? pulse_cycles-bit_cycles : bit_cycles-pulse_cycles;
+        if (err*5 <= bit_cycles && err < best_err) {
+            best_idx = i;
+            best_err = err;
         }
     }
-    return false;
+    return best_idx;
 }
+#endif
 
 uint32_t canbus_autobaud_update(struct canbus_autobaud_state_s* state) {
     if (state->success) {
-        return valid_baudrates[state->curr_baud_idx];
+        return bit_timings[state->curr_baud_idx].baud;
     }
 
-    uint32_t tnow_us = micros();
-    uint32_t time_since_switch_us = tnow_us - state->last_switch_us;
-
     struct canbus_msg msg;
     if (canbus_recv_message(&msg)) {
         state->success = true;
-        return valid_baudrates[state->curr_baud_idx];
+        return bit_timings[state->curr_baud_idx].baud;
     }
 
+#if BOARD_CONFIG_CAN_AUTOBAUD_PULSE_MEASUREMENT
+    autobaud_measure_pulses(state);
+    if (state->num_pulses >= CANBUS_AUTOBAUD_MEASURE_MIN_PULSES) {
+        int8_t baud_idx = autobaud_baud_idx_from_pulse(state->min_pulse_cycles);
+        state->min_pulse_cycles = UINT32_MAX;
+        state->num_pulses = 0;
+
+        if (baud_idx >= 0 && baud_idx != state->curr_baud_idx) {
+            // wait out a full interval for a frame at the measured rate before cycling on
+            state->curr_baud_idx = baud_idx;
+            state->last_switch_us = micros();
+            canbus_init(bit_timings[state->curr_baud_idx].baud, true, false);
+            return 0;
+        }
+    }
+#endif
+
+    uint32_t tnow_us = micros();
+    uint32_t time_since_switch_us = tnow_us - state->last_switch_us;
+
     if (time_since_switch_us >= state->switch_interval_us) {
         state->last_switch_us = tnow_us;
         if (state->curr_baud_idx == 0) {
@@ -192,39 +402,255 @@ uint32_t canbus_autobaud_update(struct canbus_autobaud_state_s* state) {
         } else {
             state->curr_baud_idx--;
         }
-        canbus_init(valid_baudrates[state->curr_baud_idx], true, false);
+        canbus_init(bit_timings[state->curr_baud_idx].baud, true, false);
     }
     return 0;
 }
 
+// The TX queue and mailbox state are shared with the TX ISR - the helpers below run either in the ISR or with
+// the TX interrupt masked.
+static void tx_queue_insert(const struct canbus_msg* msg, bool before_equal_ids) {
+    uint8_t idx = tx_queue_len;
+    while (idx > 0 && (tx_queue[idx-1].id > msg->id || (before_equal_ids && tx_queue[idx-1].id == msg->id))) {
+        tx_queue[idx] = tx_queue[idx-1];
+        idx--;
+    }
+    tx_queue[idx] = *msg;
+    tx_queue_len++;
+}
+
+static void tx_queue_remove(uint8_t idx) {
+    tx_queue_len--;
+    for (uint8_t i=idx; i<tx_queue_len; i++) {
+        tx_queue[i] = tx_queue[i+1];
+    }
+}
+
+static bool tx_id_in_mailbox(uint32_t id) {
+    for (uint8_t i=0; i<CANBUS_NUM_TX_MAILBOXES; i++) {
+        if (tx_mailboxes[i].pending && tx_mailboxes[i].msg.id == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// With TXFP cleared the controller sends the pending mailbox with the lowest ID, but picks the lowest mailbox
+// number among equal IDs. Frames of a multi-frame transfer share an ID, so at most one frame per ID may be
+// pending at a time to keep them in order.
+static void tx_fill_mailboxes(void) {
+    uint8_t idx = 0;
+    while (idx < tx_queue_len && (CAN_TSR(CAN1) & CAN_TSR_TME_MASK) != 0) {
+        const struct canbus_msg* msg = &tx_queue[idx];
+        if (tx_id_in_mailbox(msg->id)) {
+            idx++;
+            continue;
+        }
+
+        int mailbox = can_transmit(
+            CAN1,
+            msg->id,  /* (EX/ST)ID: CAN ID */
+            msg->ide, /* IDE: CAN ID extended? */
+            msg->rtr, /* RTR: Request transmit? */
+            msg->dlc, /* DLC: Data length */
+            (uint8_t*)msg->data
+        );
+
+        if (mailbox < 0 || mailbox >= CANBUS_NUM_TX_MAILBOXES) {
+            break;
+        }
+
+        tx_mailboxes[mailbox].pending = true;
+        tx_mailboxes[mailbox].abort_requested = false;
+        tx_mailboxes[mailbox].load_us = micros();
+        tx_mailboxes[mailbox].msg = *msg;
+        tx_queue_remove(idx);
+    }
+}
+
+// If every mailbox is busy and the queue head outranks one of them, abort the lowest priority mailbox.
+// The aborted frame is put back into the queue by the TX ISR.
+static void tx_preempt_mailbox(void) {
+    if (tx_queue_len == 0 || (CAN_TSR(CAN1) & CAN_TSR_TME_MASK) != 0 || tx_id_in_mailbox(tx_queue[0].id)) {
+        return;
+    }
+
+    int8_t lowest_priority_mailbox = -1;
+    for (uint8_t i=0; i<CANBUS_NUM_TX_MAILBOXES; i++) {
+        if (tx_mailboxes[i].abort_requested) {
+            return;
+        }
+        if (tx_mailboxes[i].pending && (lowest_priority_mailbox < 0 || tx_mailboxes[i].msg.id > tx_mailboxes[lowest_priority_mailbox].msg.id)) {
+            lowest_priority_mailbox = i;
+        }
+    }
+
+    if (lowest_priority_mailbox >= 0 && tx_mailboxes[lowest_priority_mailbox].msg.id > tx_queue[0].id) {
+        tx_mailboxes[lowest_priority_mailbox].abort_requested = true;
+        CAN_TSR(CAN1) = CAN_TSR_ABRQ0 << (8*lowest_priority_mailbox);
+    }
+}
+
 bool canbus_send_message(struct canbus_msg* msg) {
-    return can_transmit(
-        CAN1,
-        msg->id,  /* (EX/ST)ID: CAN ID */
-        msg->ide, /* IDE: CAN ID extended? */
-        msg->rtr, /* RTR: Request transmit? */
-        msg->dlc, /* DLC: Data length */
-        msg->data
-    ) != -1;
+    bool ret = false;
+
+    nvic_disable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+    if (tx_queue_len < CANBUS_TX_QUEUE_LEN-CANBUS_TX_QUEUE_RESERVED) {
+        tx_queue_insert(msg, false);
+        tx_fill_mailboxes();
+        tx_preempt_mailbox();
+        ret = true;
+    }
+    nvic_enable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+
+    return ret;
+}
+
+void canbus_get_tx_mailbox_stats(uint8_t mailbox, struct canbus_tx_mailbox_stats_s* stats) {
+    if (mailbox >= CANBUS_NUM_TX_MAILBOXES) {
+        return;
+    }
+
+    nvic_disable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+    *stats = tx_mailbox_stats[mailbox];
+    nvic_enable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+}
+
+void usb_hp_can1_tx_isr(void) {
+    uint32_t tsr = CAN_TSR(CAN1);
+    uint32_t tnow_us = micros();
+
+    for (uint8_t i=0; i<CANBUS_NUM_TX_MAILBOXES; i++) {
+        uint32_t rqcp = CAN_TSR_RQCP0 << (8*i);
+        if ((tsr & rqcp) == 0) {
+            continue;
+        }
+
+        // clears RQCP, TXOK, ALST and TERR of this mailbox
+        CAN_TSR(CAN1) = rqcp;
+
+        if (!tx_mailboxes[i].pending) {
+            continue;
+        }
+        tx_mailboxes[i].pending = false;
+
+        if (tsr & (CAN_TSR_TXOK0 << (8*i))) {
+            uint32_t latency_us = tnow_us - tx_mailboxes[i].load_us;
+            tx_mailbox_stats[i].frames++;
+            tx_byte_count += tx_mailboxes[i].msg.dlc;
+            tx_mailbox_stats[i].last_latency_us = latency_us;
+            tx_mailbox_stats[i].total_latency_us += latency_us;
+            if (latency_us > tx_mailbox_stats[i].max_latency_us) {
+                tx_mailbox_stats[i].max_latency_us = latency_us;
+            }
+        } else if (tx_mailboxes[i].abort_requested) {
+            // preempted by tx_preempt_mailbox, not a failed transmission
+            tx_queue_insert(&tx_mailboxes[i].msg, true);
+        } else {
+            tx_abort_count++;
+        }
+    }
+
+    tx_fill_mailboxes();
 }
 
 bool canbus_recv_message(struct canbus_msg* msg) {
-    if ((CAN_RF0R(CAN1)&0b11) == 0) {
+    if (rx_buffer_tail == rx_buffer_head) {
         return false;
     }
-    uint32_t fmi;
-    can_receive(
-        CAN1,
-        0,
-        true,
-        &(msg->id),
-        &(msg->ide),
-        &(msg->rtr),
-        &fmi,
-        &(msg->dlc),
-        msg->data);
 
-    successful_recv = true;
+    COMPILER_BARRIER();
+    *msg = rx_buffer[rx_buffer_tail];
+    COMPILER_BARRIER();
+    rx_buffer_tail = (rx_buffer_tail+1) & CANBUS_RX_BUFFER_MASK;
 
     return true;
 }
+
+uint32_t canbus_get_rx_overrun_count(void) {
+    return rx_overrun_count;
+}
+
+void canbus_get_stats(struct canbus_stats_s* stats) {
+    uint32_t esr = CAN_ESR(CAN1);
+
+    nvic_disable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+    stats->frames_tx = 0;
+    for (uint8_t i=0; i<CANBUS_NUM_TX_MAILBOXES; i++) {
+        stats->frames_tx += tx_mailbox_stats[i].frames;
+    }
+    stats->bytes_tx = tx_byte_count;
+    stats->tx_aborts = tx_abort_count;
+    nvic_enable_irq(NVIC_USB_HP_CAN1_TX_IRQ);
+
+    stats->frames_rx = rx_frame_count;
+    stats->bytes_rx = rx_byte_count;
+    stats->rx_overruns = rx_overrun_count;
+    stats->bus_off_events = bus_off_count;
+    stats->errors = error_count;
+    stats->tec = (esr & CAN_ESR_TEC_MASK) >> CAN_ESR_TEC_SHIFT;
+    stats->rec = (esr & CAN_ESR_REC_MASK) >> CAN_ESR_REC_SHIFT;
+    stats->bus_off = (esr & CAN_ESR_BOFF) != 0;
+}
+
+static void canbus_rx_fifo_isr(uint8_t fifo, volatile uint32_t* rfr) {
+    // CAN_RF0R and CAN_RF1R share the same layout
+    while ((*rfr & CAN_RF0R_FMP0_MASK) != 0) {
+        uint32_t tnow_us = micros();
+        uint8_t next_head = (rx_buffer_head+1) & CANBUS_RX_BUFFER_MASK;
+
+        if (next_head == rx_buffer_tail) {
+            // software buffer full, drop the frame
+            can_fifo_release(CAN1, fifo);
+            rx_overrun_count++;
+            continue;
+        }
+
+        struct canbus_msg* msg = &rx_buffer[rx_buffer_head];
+        uint32_t fmi;
+        can_receive(
+            CAN1,
+            fifo,
+            true,
+            &(msg->id),
+            &(msg->ide),
+            &(msg->rtr),
+            &fmi,
+            &(msg->dlc),
+            msg->data);
+        msg->timestamp_us = tnow_us;
+        rx_frame_count++;
+        rx_byte_count += msg->dlc;
+
+        COMPILER_BARRIER();
+        rx_buffer_head = next_head;
+        successful_recv = true;
+    }
+
+    if (*rfr & CAN_RF0R_FOVR0) {
+        // hardware FIFO overrun, cleared by writing 1
+        *rfr = CAN_RF0R_FOVR0;
+        rx_overrun_count++;
+    }
+}
+
+void usb_lp_can1_rx0_isr(void) {
+    canbus_rx_fifo_isr(0, &CAN_RF0R(CAN1));
+}
+
+void can1_rx1_isr(void) {
+    canbus_rx_fifo_isr(1, &CAN_RF1R(CAN1));
+}
+
+void can1_sce_isr(void) {
+    uint32_t esr = CAN_ESR(CAN1);
+    if (esr & CAN_ESR_BOFF) {
+        bus_off_count++;
+    }
+    if ((esr & CAN_ESR_LEC_MASK) != 0 && (esr & CAN_ESR_LEC_MASK) != CANBUS_ESR_LEC_UNUSED) {
+        error_count++;
+        CAN_ESR(CAN1) = CANBUS_ESR_LEC_UNUSED;
+    }
+    // cleared by writing 1
+    CAN_MSR(CAN1) = CAN_MSR_ERRI;
+}
@@ -24,6 +24,8 @@ struct canbus_autobaud_state_s {
     uint32_t last_switch_us;
     uint32_t switch_interval_us;
     uint8_t curr_baud_idx;
+    uint32_t min_pulse_cycles;
+    uint16_t num_pulses;
 };
 
 struct canbus_msg {
@@ -32,6 +34,41 @@ struct canbus_msg {
     bool rtr;
     uint8_t dlc;
     uint8_t data[8];
+    uint32_t timestamp_us;
+};
+
+#define CANBUS_NUM_TX_MAILBOXES 3
+
+// time from loading a mailbox to successful transmission
+struct canbus_tx_mailbox_stats_s {
+    uint32_t frames;
+    uint32_t last_latency_us;
+    uint32_t max_latency_us;
+    uint32_t total_latency_us;
+};
+
+// traffic counters since power up plus the controller error state sampled from CAN_ESR
+struct canbus_stats_s {
+    uint32_t frames_tx;
+    uint32_t frames_rx;
+    uint32_t bytes_tx;
+    uint32_t bytes_rx;
+    uint32_t rx_overruns;
+    uint32_t tx_aborts;
+    uint32_t bus_off_events;
+    uint32_t errors; // bus errors, one per CAN_ESR last error code the controller reported
+    uint8_t tec;
+    uint8_t rec;
+    bool bus_off;
+};
+
+#define CANBUS_NUM_FILTER_BANKS 14
+
+// accepts extended frames with (frame_id & mask) == (id & mask)
+struct canbus_filter_s {
+    uint32_t id;
+    uint32_t mask;
+    uint8_t fifo;
 };
 
 void canbus_autobaud_start(struct canbus_autobaud_state_s* state, uint32_t initial_baud, uint32_t switch_interval_us);
@@ -41,5 +78,10 @@ bool canbus_baudrate_valid(uint32_t baud);
 uint32_t canbus_get_baudrate(void);
 uint32_t canbus_get_confirmed_baudrate(void);
 void canbus_init(uint32_t baud, bool silent, bool auto_retransmit);
+void canbus_deinit(void);
+void canbus_set_filters(const struct canbus_filter_s* new_filters, uint8_t new_num_filters);
 bool canbus_send_message(struct canbus_msg* msg);
 bool canbus_recv_message(struct canbus_msg* msg);
+void canbus_get_tx_mailbox_stats(uint8_t mailbox, struct canbus_tx_mailbox_stats_s* stats);
+uint32_t canbus_get_rx_overrun_count(void);
+void canbus_get_stats(struct canbus_stats_s* stats);
@@ -1,7 +1,37 @@
 #include <flash.h>
+#include <libopencm3/cm3/nvic.h>
+#include <profiling.h>
+
+#define FLASH_JOB_QUEUE_LEN 8
+
+enum flash_job_type_t {
+    FLASH_JOB_ERASE_PAGE,
+    FLASH_JOB_PROGRAM,
+    FLASH_JOB_PROGRAM_SKIP_ERASED
+};
+
+struct flash_job_s {
+    enum flash_job_type_t type;
+    volatile uint16_t* addr;
+    const uint16_t* src;
+    uint32_t num_half_words;
+};
+
+static struct flash_job_s job_queue[FLASH_JOB_QUEUE_LEN];
+static volatile uint8_t job_queue_head; // written by the main loop only
+static volatile uint8_t job_queue_tail; // written by the ISR only
+static volatile bool job_running;
+static volatile bool job_error;
+static volatile uint32_t jobs_completed;
+static uint32_t jobs_submitted;
+static uint32_t job_half_word_idx;
+#ifdef BOARD_CONFIG_PROFILING
+static uint32_t job_start_cycles;
+#endif
 
 bool __attribute__ ((noinline)) flash_program_half_word(uint16_t* addr, const uint16_t* src)
 {
+    PROFILE_ZONE_BEGIN(SHARED_BOOT_PROFILE_ZONE_FLASH_SYNC);
     bool ret;
     flash_unlock();
     // 1. Check that no main Flash memory operation is ongoing by checking the BSY bit in the FLASH_SR register.
@@ -21,11 +51,13 @@ bool __attribute__ ((noinline)) flash_program_half_word(uint16_t* addr, const ui
     flash_wait_for_last_operation();
     flash_lock();
 
+    PROFILE_ZONE_END(SHARED_BOOT_PROFILE_ZONE_FLASH_SYNC);
     return ret;
 }
 
 bool __attribute__ ((noinline)) flash_erase_page(void* addr)
 {
+    PROFILE_ZONE_BEGIN(SHARED_BOOT_PROFILE_ZONE_FLASH_SYNC);
     flash_unlock();
     bool ret;
     // 1. Check that no Flash memory operation is ongoing by checking the BSY bit in the FLASH_CR register.
@@ -45,5 +77,165 @@ bool __attribute__ ((noinline)) flash_erase_page(void* addr)
     FLASH_CR &= ~FLASH_CR_PER;
 
     flash_lock();
+    PROFILE_ZONE_END(SHARED_BOOT_PROFILE_ZONE_FLASH_SYNC);
     return ret;
 }
+
+// starts the job at the tail of the queue - called with the FLASH interrupt masked or from the ISR
+static void start_next_job(void)
+{
+    if (job_queue_tail == job_queue_head) {
+        FLASH_CR &= ~(FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+        flash_lock();
+        job_running = false;
+        return;
+    }
+
+    const struct flash_job_s* job = &job_queue[job_queue_tail];
+    job_running = true;
+    job_half_word_idx = 0;
+#ifdef BOARD_CONFIG_PROFILING
+    job_start_cycles = DWT_CYCCNT;
+#endif
+
+    if (job->type == FLASH_JOB_ERASE_PAGE) {
+        FLASH_CR |= FLASH_CR_PER;
+        FLASH_AR = (uint32_t)job->addr;
+        FLASH_CR |= FLASH_CR_STRT;
+    } else {
+        FLASH_CR |= FLASH_CR_PG;
+        job->addr[0] = job->src[0];
+    }
+}
+
+void flash_isr(void)
+{
+    uint32_t sr = FLASH_SR;
+    FLASH_SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+
+    if (!job_running) {
+        return;
+    }
+
+    const struct flash_job_s* job = &job_queue[job_queue_tail];
+
+    if (sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) {
+        // drop everything that is queued, the caller has to start over
+        FLASH_CR &= ~(FLASH_CR_PG | FLASH_CR_PER);
+        job_error = true;
+        jobs_completed += (uint8_t)(job_queue_head - job_queue_tail + FLASH_JOB_QUEUE_LEN) % FLASH_JOB_QUEUE_LEN;
+        job_queue_tail = job_queue_head;
+        start_next_job();
+        return;
+    }
+
+    if (job->type != FLASH_JOB_ERASE_PAGE) {
+        while (++job_half_word_idx < job->num_half_words) {
+            if (job->type == FLASH_JOB_PROGRAM_SKIP_ERASED && job->src[job_half_word_idx] == 0xFFFF) {
+                continue;
+            }
+            // PG is still set, program the next half-word
+            job->addr[job_half_word_idx] = job->src[job_half_word_idx];
+            return;
+        }
+    }
+
+    FLASH_CR &= ~(FLASH_CR_PG | FLASH_CR_PER);
+#ifdef BOARD_CONFIG_PROFILING
+    profile_zone_record(SHARED_BOOT_PROFILE_ZONE_FLASH_JOB, DWT_CYCCNT-job_start_cycles);
+#endif
+    job_queue_tail = (job_queue_tail+1) % FLASH_JOB_QUEUE_LEN;
+    jobs_completed++;
+    start_next_job();
+}
+
+static uint32_t flash_async_submit(enum flash_job_type_t type, void* addr, const void* src, uint32_t num_half_words)
+{
+    if (!flash_async_can_submit(1)) {
+        return 0;
+    }
+
+    struct flash_job_s* job = &job_queue[job_queue_head];
+    job->type = type;
+    job->addr = (volatile uint16_t*)addr;
+    job->src = (const uint16_t*)src;
+    job->num_half_words = num_half_words;
+
+    nvic_disable_irq(NVIC_FLASH_IRQ);
+    job_queue_head = (job_queue_head+1) % FLASH_JOB_QUEUE_LEN;
+    jobs_submitted++;
+    if (!job_running) {
+        flash_unlock();
+        FLASH_SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+        FLASH_CR |= FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+        start_next_job();
+    }
+    nvic_enable_irq(NVIC_FLASH_IRQ);
+
+    return jobs_submitted;
+}
+
+uint32_t flash_async_erase_page(void* addr)
+{
+    return flash_async_submit(FLASH_JOB_ERASE_PAGE, addr, 0, 0);
+}
+
+uint32_t flash_async_program(void* addr, const void* src, uint32_t len)
+{
+    return flash_async_submit(FLASH_JOB_PROGRAM, addr, src, (len+1)/sizeof(uint16_t));
+}
+
+uint32_t flash_async_program_skip_erased(void* addr, const void* src, uint32_t len)
+{
+    uint32_t num_half_words = (len+1)/sizeof(uint16_t);
+    const uint16_t* src_half_words = src;
+
+    // the job is started by programming its first half-word, so leading erased ones are dropped here
+    uint32_t first = 0;
+    while (first < num_half_words && src_half_words[first] == 0xFFFF) {
+        first++;
+    }
+
+    if (first == num_half_words) {
+        return jobs_submitted;
+    }
+
+    return flash_async_submit(FLASH_JOB_PROGRAM_SKIP_ERASED, (uint16_t*)addr+first, &src_half_words[first], num_half_words-first);
+}
+
+bool flash_async_can_submit(uint8_t num_jobs)
+{
+    uint8_t used = (uint8_t)(job_queue_head - job_queue_tail + FLASH_JOB_QUEUE_LEN) % FLASH_JOB_QUEUE_LEN;
+    return used + num_jobs < FLASH_JOB_QUEUE_LEN;
+}
+
+bool flash_async_job_done(uint32_t job_id)
+{
+    return (int32_t)(jobs_completed - job_id) >= 0;
+}
+
+bool flash_async_idle(void)
+{
+    return !job_running;
+}
+
+bool flash_async_error(void)
+{
+    return job_error;
+}
+
+// drops all queued jobs, waits for the current operation to finish and clears the error flag
+void flash_async_abort(void)
+{
+    nvic_disable_irq(NVIC_FLASH_IRQ);
+    flash_wait_for_last_operation();
+    FLASH_CR &= ~(FLASH_CR_PG | FLASH_CR_PER | FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+    FLASH_SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+    flash_lock();
+    jobs_completed = jobs_submitted;
+    job_queue_tail = job_queue_head;
+    job_running = false;
+    job_error = false;
+    nvic_clear_pending_irq(NVIC_FLASH_IRQ);
+    nvic_enable_irq(NVIC_FLASH_IRQ);
+}
@@ -6,3 +6,17 @@
 
 bool flash_program_half_word(uint16_t* addr, const uint16_t* src);
 bool flash_erase_page(void* addr);
+
+// Asynchronous flash engine - jobs are executed in order from the FLASH interrupt.
+// The submit functions return a job id, or 0 if the queue is full. Source data passed to
+// flash_async_program must remain valid until flash_async_job_done returns true for its job.
+uint32_t flash_async_erase_page(void* addr);
+uint32_t flash_async_program(void* addr, const void* src, uint32_t len);
+// Like flash_async_program for an erased destination: half-words equal to 0xFFFF are not programmed.
+// If there is nothing to program, the id of the last submitted job is returned.
+uint32_t flash_async_program_skip_erased(void* addr, const void* src, uint32_t len);
+bool flash_async_can_submit(uint8_t num_jobs);
+bool flash_async_job_done(uint32_t job_id);
+bool flash_async_idle(void);
+bool flash_async_error(void);
+void flash_async_abort(void);
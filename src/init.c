@@ -21,70 +21,107 @@
 static void init_clock_stm32f3_8mhz_hse(void);
 static void init_clock_stm32f3_24mhz_hse(void);
 
+enum init_clock_stage_t {
+    INIT_CLOCK_STAGE_WAIT_HSE,
+    INIT_CLOCK_STAGE_WAIT_PLL,
+    INIT_CLOCK_STAGE_DONE
+};
+
+static enum init_clock_stage_t init_clock_stage;
+
 void init_clock(void) {
+    init_clock_begin();
+    while (!init_clock_update());
+}
+
+// starts the HSE and leaves the core on the 8MHz HSI it comes out of reset with
+void init_clock_begin(void) {
+    rcc_ahb_frequency = 8000000;
+    rcc_apb1_frequency = 8000000;
+    rcc_apb2_frequency = 8000000;
+
+    rcc_osc_on(RCC_HSE);
+    init_clock_stage = INIT_CLOCK_STAGE_WAIT_HSE;
+}
+
+// starts the PLL once the HSE is up and switches to it once it locks - returns true from then on
+bool init_clock_update(void) {
+    switch (init_clock_stage) {
+        case INIT_CLOCK_STAGE_WAIT_HSE:
+            if (!rcc_is_osc_ready(RCC_HSE)) {
+                return false;
+            }
+
+            rcc_osc_off(RCC_PLL);
+            rcc_wait_for_osc_not_ready(RCC_PLL);
 #if defined(BOARD_CONFIG_MCU_STM32F3) && defined(BOARD_CONFIG_OSC_HSE_8MHZ)
-    init_clock_stm32f3_8mhz_hse();
+            init_clock_stm32f3_8mhz_hse();
 #elif defined(BOARD_CONFIG_MCU_STM32F3) && defined(BOARD_CONFIG_OSC_HSE_24MHZ)
-    init_clock_stm32f3_24mhz_hse();
+            init_clock_stm32f3_24mhz_hse();
 #else
-    #error "Could not find valid clock config"
+            #error "Could not find valid clock config"
 #endif
-}
+            rcc_osc_on(RCC_PLL);
+            init_clock_stage = INIT_CLOCK_STAGE_WAIT_PLL;
+            return false;
 
-static void init_clock_stm32f3_8mhz_hse(void)
-{
-    rcc_osc_on(RCC_HSE);
-    rcc_wait_for_osc_ready(RCC_HSE);
-    rcc_set_sysclk_source(RCC_CFGR_SW_HSE);
-    rcc_wait_for_sysclk_status(RCC_HSE);
+        case INIT_CLOCK_STAGE_WAIT_PLL:
+            if (!rcc_is_osc_ready(RCC_PLL)) {
+                return false;
+            }
 
-    rcc_osc_off(RCC_PLL);
-    rcc_wait_for_osc_not_ready(RCC_PLL);
-    rcc_set_prediv(RCC_CFGR2_PREDIV_NODIV); // 8 Mhz
-    rcc_set_pll_source(RCC_CFGR_PLLSRC_HSE_PREDIV);
-    rcc_set_pll_multiplier(RCC_CFGR_PLLMUL_PLL_IN_CLK_X9); // 72 MHz
+            rcc_set_hpre(RCC_CFGR_HPRE_DIV_NONE); // 72 MHz
+            rcc_set_ppre1(RCC_CFGR_PPRE1_DIV_2); // 36 MHz
+            rcc_set_ppre2(RCC_CFGR_PPRE2_DIV_NONE); // 72 MHz
+            flash_set_ws(FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY_2WS);
+            rcc_set_sysclk_source(RCC_CFGR_SW_PLL);
+            rcc_wait_for_sysclk_status(RCC_PLL);
 
-    rcc_set_hpre(RCC_CFGR_HPRE_DIV_NONE); // 72 MHz
-    rcc_ahb_frequency = 72000000;
+            rcc_ahb_frequency = 72000000;
+            rcc_apb1_frequency = INIT_CLOCK_APB1_FREQUENCY;
+            rcc_apb2_frequency = 72000000;
 
-    rcc_set_ppre1(RCC_CFGR_PPRE1_DIV_2); // 36 MHz
-    rcc_apb1_frequency = 36000000;
+            init_clock_stage = INIT_CLOCK_STAGE_DONE;
+            return true;
 
-    rcc_set_ppre2(RCC_CFGR_PPRE2_DIV_NONE); // 72 MHz
-    rcc_apb2_frequency = 72000000;
+        case INIT_CLOCK_STAGE_DONE:
+            return true;
+    }
 
-    rcc_osc_on(RCC_PLL);
-    rcc_wait_for_osc_ready(RCC_PLL);
-    flash_set_ws(FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY_2WS);
-    rcc_set_sysclk_source(RCC_CFGR_SW_PLL);
-    rcc_wait_for_sysclk_status(RCC_PLL);
+    return false;
 }
 
-static void init_clock_stm32f3_24mhz_hse(void)
-{
-    rcc_osc_on(RCC_HSE);
-    rcc_wait_for_osc_ready(RCC_HSE);
-    rcc_set_sysclk_source(RCC_CFGR_SW_HSE);
-    rcc_wait_for_sysclk_status(RCC_HSE);
+// back to the 8MHz HSI the chip comes out of reset with
+void deinit_clock(void) {
+    rcc_osc_on(RCC_HSI);
+    rcc_wait_for_osc_ready(RCC_HSI);
+    rcc_set_sysclk_source(RCC_CFGR_SW_HSI);
+    rcc_wait_for_sysclk_status(RCC_HSI);
 
     rcc_osc_off(RCC_PLL);
     rcc_wait_for_osc_not_ready(RCC_PLL);
-    rcc_set_prediv(RCC_CFGR2_PREDIV_DIV3); // 24 -> 8 Mhz
-    rcc_set_pll_source(RCC_CFGR_PLLSRC_HSE_PREDIV);
-    rcc_set_pll_multiplier(RCC_CFGR_PLLMUL_PLL_IN_CLK_X9); // 72 MHz
+    rcc_osc_off(RCC_HSE);
 
-    rcc_set_hpre(RCC_CFGR_HPRE_DIV_NONE); // 72 MHz
-    rcc_ahb_frequency = 72000000;
+    RCC_CFGR = 0;
+    RCC_CFGR2 = 0;
+    RCC_CIR = 0;
+    flash_set_ws(FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY_0WS);
 
-    rcc_set_ppre1(RCC_CFGR_PPRE1_DIV_2); // 36 MHz
-    rcc_apb1_frequency = 36000000;
+    rcc_ahb_frequency = 8000000;
+    rcc_apb1_frequency = 8000000;
+    rcc_apb2_frequency = 8000000;
+}
 
-    rcc_set_ppre2(RCC_CFGR_PPRE2_DIV_NONE); // 72 MHz
-    rcc_apb2_frequency = 72000000;
+static void init_clock_stm32f3_8mhz_hse(void)
+{
+    rcc_set_prediv(RCC_CFGR2_PREDIV_NODIV); // 8 Mhz
+    rcc_set_pll_source(RCC_CFGR_PLLSRC_HSE_PREDIV);
+    rcc_set_pll_multiplier(RCC_CFGR_PLLMUL_PLL_IN_CLK_X9); // 72 MHz
+}
 
-    rcc_osc_on(RCC_PLL);
-    rcc_wait_for_osc_ready(RCC_PLL);
-    flash_set_ws(FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY_2WS);
-    rcc_set_sysclk_source(RCC_CFGR_SW_PLL);
-    rcc_wait_for_sysclk_status(RCC_PLL);
+static void init_clock_stm32f3_24mhz_hse(void)
+{
+    rcc_set_prediv(RCC_CFGR2_PREDIV_DIV3); // 24 -> 8 Mhz
+    rcc_set_pll_source(RCC_CFGR_PLLSRC_HSE_PREDIV);
+    rcc_set_pll_multiplier(RCC_CFGR_PLLMUL_PLL_IN_CLK_X9); // 72 MHz
 }
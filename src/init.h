@@ -15,5 +15,13 @@
 
 #pragma once
 
+#include <stdbool.h>
+
+// APB1 clock once init_clock_update has switched to the PLL, the CAN bit timings are built for it
+#define INIT_CLOCK_APB1_FREQUENCY 36000000UL
+
 void init_clock(void);
+void init_clock_begin(void);
+bool init_clock_update(void);
+void deinit_clock(void);
 void init_gpio_can(void);
@@ -0,0 +1,53 @@
+#include <lzss.h>
+#include <string.h>
+
+void lzss_decoder_init(struct lzss_decoder_s* dec)
+{
+    memset(dec, 0, sizeof(*dec));
+}
+
+static void lzss_output(struct lzss_decoder_s* dec, uint8_t b, uint8_t* out)
+{
+    dec->window[dec->window_pos] = b;
+    dec->window_pos = (dec->window_pos+1) % LZSS_WINDOW_SIZE;
+    *out = b;
+}
+
+uint32_t lzss_decode(struct lzss_decoder_s* dec, const uint8_t* in, uint32_t* in_len, uint8_t* out, uint32_t out_len)
+{
+    uint32_t in_pos = 0;
+    uint32_t out_pos = 0;
+
+    while (out_pos < out_len) {
+        if (dec->match_len > 0) {
+            uint8_t b = dec->window[(uint16_t)(dec->window_pos - dec->match_dist) % LZSS_WINDOW_SIZE];
+            lzss_output(dec, b, &out[out_pos++]);
+            dec->match_len--;
+            continue;
+        }
+
+        if (in_pos >= *in_len) {
+            break;
+        }
+
+        uint8_t c = in[in_pos++];
+
+        if (dec->flags <= 1) {
+            dec->flags = 0x100 | c;
+        } else if (dec->flags & 1) {
+            lzss_output(dec, c, &out[out_pos++]);
+            dec->flags >>= 1;
+        } else if (!dec->have_match_byte0) {
+            dec->match_byte0 = c;
+            dec->have_match_byte0 = true;
+        } else {
+            dec->match_dist = (dec->match_byte0 | ((uint16_t)(c & 0x30) << 4)) + 1;
+            dec->match_len = (c & 0x0f) + LZSS_MIN_MATCH;
+            dec->have_match_byte0 = false;
+            dec->flags >>= 1;
+        }
+    }
+
+    *in_len = in_pos;
+    return out_pos;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// LZSS as packed by tools/crc_binary.py: a flag byte precedes every group of 8 tokens, LSB first.
+// A set flag is a literal byte, a clear flag a 2 byte match:
+// byte 0 = (distance-1) & 0xff, byte 1 = ((distance-1) >> 8) << 4 | (length-LZSS_MIN_MATCH)
+#define LZSS_WINDOW_SIZE 1024
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH 18
+
+struct lzss_decoder_s {
+    uint8_t window[LZSS_WINDOW_SIZE];
+    uint16_t window_pos;
+    uint16_t flags; // flags of the current group, shifted out as tokens are decoded - 1 when the group is done
+    bool have_match_byte0;
+    uint8_t match_byte0;
+    uint16_t match_dist;
+    uint8_t match_len; // bytes of the current match not yet output
+};
+
+void lzss_decoder_init(struct lzss_decoder_s* dec);
+// decodes until out_len bytes are output or the input runs out, returns the number of bytes output
+// *in_len is updated to the number of input bytes consumed
+uint32_t lzss_decode(struct lzss_decoder_s* dec, const uint8_t* in, uint32_t* in_len, uint8_t* out, uint32_t out_len);
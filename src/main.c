@@ -21,6 +21,9 @@
 #include <uavcan.h>
 #include <flash.h>
 #include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/stm32/rcc.h>
 #include <string.h>
 #include <shared_app_descriptor.h>
 #include <shared_boot_msg.h>
@@ -28,6 +31,9 @@
 #include <stdlib.h>
 #include <profiLED_gen.h>
 #include <helpers.h>
+#include <lzss.h>
+#include <persistent_store.h>
+#include <profiling.h>
 
 #ifdef STM32F3
 #define APP_PAGE_SIZE 2048
@@ -36,6 +42,82 @@
 #define CANBUS_AUTOBAUD_SWITCH_INTERVAL_US 1000000
 #define CANBUS_AUTOBAUD_TIMEOUT_US 10000000
 
+#define FILE_READ_CHUNK_SIZE 256
+
+// bytes of the image crc checked per bootloader_update while the bus comes up
+#ifndef BOARD_CONFIG_APP_VERIFY_CHUNK_SIZE
+#define BOARD_CONFIG_APP_VERIFY_CHUNK_SIZE 1024
+#endif
+
+// boot the app straight from the main loop after putting the peripherals back to their reset state,
+// set to 0 to hand the BOOT message to bootloader_pre_init through a system reset instead
+#ifndef BOARD_CONFIG_BOOT_DIRECT_JUMP
+#define BOARD_CONFIG_BOOT_DIRECT_JUMP 1
+#endif
+
+// interval between the profiling KeyValues, one zone statistic or milestone each - BOARD_CONFIG_PROFILING builds also
+// boot the app with SHARED_MSG_BOOT_INFO_PROFILED, see profiling.h
+#ifndef BOARD_CONFIG_PROFILING_PUBLISH_INTERVAL_MS
+#define BOARD_CONFIG_PROFILING_PUBLISH_INTERVAL_MS 100
+#endif
+
+// interval between the CAN statistics KeyValues, one counter each, 0 disables them - off by default as every node
+// on the bus would keep publishing, GetTransportStats serves the same counters on request
+#ifndef BOARD_CONFIG_CAN_STATS_PUBLISH_INTERVAL_MS
+#define BOARD_CONFIG_CAN_STATS_PUBLISH_INTERVAL_MS 0
+#endif
+
+// NodeStatus vendor specific status code while the image is being checked
+#define NODE_STATUS_VENDOR_VERIFYING_APP 1
+
+// number of File.Read requests kept in flight during a firmware update
+#ifndef BOARD_CONFIG_FILE_READ_WINDOW_SIZE
+#define BOARD_CONFIG_FILE_READ_WINDOW_SIZE 4
+#endif
+
+// fetch <path>.pages first and only download the pages whose crc32 differs from what is already in flash
+#ifndef BOARD_CONFIG_DELTA_UPDATE
+#define BOARD_CONFIG_DELTA_UPDATE 1
+#endif
+
+#define DELTA_MANIFEST_SUFFIX ".pages"
+#define DELTA_MANIFEST_MAGIC 0x50444D4FUL // "OMDP"
+
+// manifest layout, little endian, generated by tools/crc_binary.py
+struct delta_manifest_header_s {
+    uint32_t magic;
+    uint16_t page_size;
+    uint16_t num_pages;
+    uint32_t image_size;
+    // followed by a crc32 of each page of the image, the last page only up to image_size
+} __attribute__((packed));
+
+// files starting with this header are LZSS compressed images, packed by tools/crc_binary.py
+#ifndef BOARD_CONFIG_COMPRESSED_UPDATE
+#define BOARD_CONFIG_COMPRESSED_UPDATE 1
+#endif
+
+#define COMPRESSED_IMAGE_MAGIC 0x5A444D4FUL // "OMDZ"
+
+struct compressed_image_header_s {
+    uint32_t magic;
+    uint32_t image_size;
+} __attribute__((packed));
+
+// boots between full image crc checks while the validation record is trusted, if the app parameters do not say
+#ifndef BOARD_CONFIG_IMAGE_VERIFY_INTERVAL
+#define BOARD_CONFIG_IMAGE_VERIFY_INTERVAL 16
+#endif
+
+// written once the image crc has been checked, so later boots can skip the check while the app region is unchanged
+struct validated_image_record_s {
+    uint32_t flash_generation; // bumped whenever the bootloader starts programming the app region
+    uint32_t descriptor_ofs;
+    uint32_t image_size;
+    uint64_t image_crc;
+    uint32_t boot_count; // PERSISTENT_STORE_KEY_BOOT_COUNT when the image was checked
+} __attribute__((packed));
+
 struct app_header_s {
     uint32_t stacktop;
     uint32_t entrypoint;
@@ -43,6 +125,10 @@ struct app_header_s {
 
 // NOTE: _app_sec and _app_sec_end symbols shall be defined in the ld script
 extern uint8_t _app_sec[], _app_sec_end;
+// the store page follows the app region
+extern uint8_t _bl_store_sec_end;
+// NOTE: _ram_sec and _ram_sec_end symbols shall be defined in the ld script - all of RAM, app_bl_shared included
+extern uint8_t _ram_sec[], _ram_sec_end;
 
 // NOTE: _hw_info defined in the board config file
 const struct shared_hw_info_s _hw_info = BOARD_CONFIG_HW_INFO_STRUCTURE;
@@ -50,17 +136,73 @@ const struct shared_hw_info_s _hw_info = BOARD_CONFIG_HW_INFO_STRUCTURE;
 static bool restart_req = false;
 static uint32_t restart_req_us;
 
-static struct {
-    bool in_progress;
-    uint32_t ofs;
+// image bytes are collected a page at a time, so pages that did not change are neither erased nor programmed
+struct page_buf_s {
+    uint32_t flash_job_id;
+    uint8_t data[APP_PAGE_SIZE] __attribute__((aligned(4)));
+};
+
+// one outstanding File.Read request - chunk at ofs lives in slot (ofs/FILE_READ_CHUNK_SIZE)%BOARD_CONFIG_FILE_READ_WINDOW_SIZE
+struct file_read_slot_s {
+    bool active;
+    bool received;
+    bool eof;
     uint8_t transfer_id;
     uint8_t retries;
+    uint16_t data_len;
+    uint32_t ofs;
     uint32_t last_req_ms;
+    uint8_t data[FILE_READ_CHUNK_SIZE] __attribute__((aligned(4)));
+};
+
+static struct {
+    bool in_progress;
+    uint32_t ofs; // file offset of the next chunk to be written to flash
+    uint32_t write_ofs; // image offset the next bytes are written to, differs from ofs for compressed files
+    uint32_t req_ofs; // offset of the next chunk to be requested
+    bool eof_received;
+    uint32_t eof_ofs;
+    bool eof_committed;
     uint8_t source_node_id;
-    int32_t last_erased_page;
     char path[201];
+    uint64_t path_hash;
+    uint64_t crc64; // crc64_we of all image bytes below write_ofs, computed the way update_app_info does
+    uint8_t descriptor_sig_matched; // bytes of the descriptor signature matched at the end of the bytes so far
+    uint32_t image_crc_ofs; // offset of the image_crc field in the new image, 0 until its descriptor has been seen
+    // the app header is held back until the whole image is in flash, so a partial image can never be booted
+    uint8_t app_header[sizeof(struct app_header_s)];
+    bool progress_pending;
+    uint32_t progress_ofs;
+    uint64_t progress_crc64;
+    uint32_t progress_image_crc_ofs;
+    uint32_t progress_flash_job_id;
+    uint32_t last_flash_job_id;
+    bool fetching_manifest;
+    bool delta;
+    uint64_t skip_page_mask; // pages of the new image already present in flash
+    bool compressed;
+    uint32_t image_size; // size of the decompressed image
+#if BOARD_CONFIG_COMPRESSED_UPDATE
+    uint16_t in_consumed; // bytes of the slot at ofs already fed to the decoder
+    struct lzss_decoder_s lzss;
+#endif
+    uint16_t page_buf_len; // bytes of the page below write_ofs held in the current page buffer
+    uint8_t page_buf_idx;
+    struct page_buf_s page_bufs[2];
+    struct file_read_slot_s slots[BOARD_CONFIG_FILE_READ_WINDOW_SIZE];
 } flash_state;
 
+static struct {
+    uint32_t pages_skipped; // identical to flash, neither erased nor programmed
+    uint32_t half_words_skipped; // left erased instead of being programmed with 0xFFFF
+} flash_write_stats;
+
+static struct shared_update_progress_msg_s update_progress;
+static bool update_progress_valid;
+
+// set when a delta update produced a bad image, the next update downloads everything
+static bool delta_update_disabled;
+
 static struct {
     bool enable;
     uint32_t start_ms;
@@ -78,14 +220,16 @@ static struct {
     const struct shared_app_parameters_s* shared_app_parameters;
 } app_info;
 
-static void write_data_to_flash(uint32_t ofs, const uint8_t* data, uint32_t data_len)
-{
-    for (uint16_t i=0; i<data_len; i+=sizeof(uint16_t)) {
-        uint16_t* src_ptr = (uint16_t*)&data[i];
-        uint16_t* dest_ptr = (uint16_t*)&_app_sec[i+ofs];
+static struct {
+    bool in_progress;
+    uint32_t ofs;
+    uint64_t crc64;
+} app_verify;
 
-        flash_program_half_word(dest_ptr, src_ptr);
-    }
+// queues the write to an erased area, data must stay valid until the returned flash job is done
+static uint32_t write_data_to_flash(uint32_t ofs, const uint8_t* data, uint32_t data_len)
+{
+    return flash_async_program_skip_erased(&_app_sec[ofs], data, data_len);
 }
 
 static void start_boot_timer(uint32_t length_ms) {
@@ -106,61 +250,250 @@ static uint32_t get_app_sec_size(void) {
     return (uint32_t)&_app_sec_end - (uint32_t)&_app_sec[0];
 }
 
-static void update_uavcan_node_info_and_status(void)
+// an image installed while the app region still took in the store page keeps running, the store stays off meanwhile
+static uint32_t get_app_image_max_size(void) {
+    return persistent_store_enabled() ? get_app_sec_size() : (uint32_t)&_bl_store_sec_end - (uint32_t)&_app_sec[0];
+}
+
+// node info only depends on the verified app descriptor, so it is handed over only when that changes
+static void update_uavcan_node_info(void)
 {
+    static bool published;
+    static const struct shared_app_descriptor_s* published_descriptor;
+    static uint64_t published_image_crc;
+
+    const struct shared_app_descriptor_s* descriptor = app_info.image_crc_correct ? app_info.shared_app_descriptor : NULL;
+    if (published && descriptor == published_descriptor && (!descriptor || descriptor->image_crc == published_image_crc)) {
+        return;
+    }
+
     struct uavcan_node_info_s uavcan_node_info;
     memset(&uavcan_node_info, 0, sizeof(uavcan_node_info));
     uavcan_node_info.hw_name = _hw_info.hw_name;
     uavcan_node_info.hw_major_version = _hw_info.hw_major_version;
     uavcan_node_info.hw_minor_version = _hw_info.hw_minor_version;
 
-    if (app_info.shared_app_descriptor && app_info.image_crc_correct) {
-        uavcan_node_info.sw_major_version = app_info.shared_app_descriptor->major_version;
-        uavcan_node_info.sw_minor_version = app_info.shared_app_descriptor->minor_version;
+    if (descriptor) {
+        uavcan_node_info.sw_major_version = descriptor->major_version;
+        uavcan_node_info.sw_minor_version = descriptor->minor_version;
         uavcan_node_info.sw_vcs_commit_available = true;
-        uavcan_node_info.sw_vcs_commit = app_info.shared_app_descriptor->vcs_commit;
+        uavcan_node_info.sw_vcs_commit = descriptor->vcs_commit;
         uavcan_node_info.sw_image_crc_available = true;
-        uavcan_node_info.sw_image_crc = app_info.shared_app_descriptor->image_crc;
+        uavcan_node_info.sw_image_crc = descriptor->image_crc;
     }
 
-    uavcan_set_node_info(uavcan_node_info);
+    uavcan_set_node_info(&uavcan_node_info);
+
+    published = true;
+    published_descriptor = descriptor;
+    published_image_crc = descriptor ? descriptor->image_crc : 0;
+}
+
+static void update_uavcan_node_info_and_status(void)
+{
+    update_uavcan_node_info();
+
+    uavcan_set_node_vendor_status(app_verify.in_progress ? NODE_STATUS_VENDOR_VERIFYING_APP : 0);
 
     if (flash_state.in_progress) {
         uavcan_set_node_mode(UAVCAN_MODE_SOFTWARE_UPDATE);
         uavcan_set_node_health(UAVCAN_HEALTH_OK);
+    } else if (app_verify.in_progress) {
+        uavcan_set_node_mode(UAVCAN_MODE_INITIALIZATION);
+        uavcan_set_node_health(UAVCAN_HEALTH_OK);
     } else {
         uavcan_set_node_mode(UAVCAN_MODE_MAINTENANCE);
         uavcan_set_node_health(app_info.image_crc_correct ? UAVCAN_HEALTH_OK : UAVCAN_HEALTH_CRITICAL);
     }
 }
 
+// the vector table must point into RAM and the app region - an update holds the header back until it is complete
+static bool app_header_valid(void)
+{
+    const struct app_header_s* app_header = (const struct app_header_s*)_app_sec;
+    uint32_t entry_addr = app_header->entrypoint & ~1U;
+
+    return app_header->stacktop % 4 == 0 && app_header->stacktop > (uint32_t)_ram_sec && app_header->stacktop <= (uint32_t)&_ram_sec_end &&
+        (app_header->entrypoint & 1) && entry_addr >= (uint32_t)_app_sec && entry_addr < (uint32_t)_app_sec+get_app_image_max_size();
+}
+
+static bool app_descriptor_valid(const struct shared_app_descriptor_s* descriptor)
+{
+    return descriptor && descriptor->image_size >= sizeof(struct shared_app_descriptor_s) && descriptor->image_size <= get_app_image_max_size();
+}
+
+// crc64_we of len bytes found at image offset ofs, with the 8 bytes at image_crc_ofs taken as zero (if image_crc_ofs is not 0)
+static uint64_t image_crc64(const uint8_t* data, uint32_t len, uint32_t ofs, uint32_t image_crc_ofs, uint64_t crc)
+{
+    if (image_crc_ofs == 0 || image_crc_ofs >= ofs+len || image_crc_ofs+sizeof(uint64_t) <= ofs) {
+        return crc64_we(data, len, crc);
+    }
+
+    uint32_t field_begin = MAX(image_crc_ofs, ofs)-ofs;
+    uint32_t field_end = MIN(image_crc_ofs+sizeof(uint64_t), ofs+len)-ofs;
+    uint64_t zero64 = 0;
+
+    crc = crc64_we(data, field_begin, crc);
+    crc = crc64_we((uint8_t*)&zero64, field_end-field_begin, crc);
+    return crc64_we(&data[field_end], len-field_end, crc);
+}
+
+static uint32_t get_flash_generation(void)
+{
+    uint32_t flash_generation = 0;
+    persistent_store_read(PERSISTENT_STORE_KEY_FLASH_GENERATION, &flash_generation, sizeof(flash_generation));
+    return flash_generation;
+}
+
+// call before programming the app region - invalidates the validation record, the app region must not be
+// touched if this fails
+static bool bump_flash_generation(void)
+{
+    // the store can only be written with no asynchronous flash jobs pending
+    while (!flash_async_idle());
+
+    // the app running into the store page is about to be overwritten
+    if (!persistent_store_reclaim()) {
+        return false;
+    }
+
+    uint32_t flash_generation = get_flash_generation()+1;
+    return persistent_store_write(PERSISTENT_STORE_KEY_FLASH_GENERATION, &flash_generation, sizeof(flash_generation));
+}
+
+static void save_validated_image_record(void)
+{
+    struct validated_image_record_s record;
+    memset(&record, 0, sizeof(record));
+    record.flash_generation = get_flash_generation();
+    record.descriptor_ofs = (uint32_t)app_info.shared_app_descriptor - (uint32_t)_app_sec;
+    record.image_size = app_info.shared_app_descriptor->image_size;
+    record.image_crc = app_info.image_crc_computed;
+    record.boot_count = persistent_store_counter_read(PERSISTENT_STORE_KEY_BOOT_COUNT);
+    persistent_store_write(PERSISTENT_STORE_KEY_VALIDATED_IMAGE, &record, sizeof(record));
+}
+
+// starts checking the image crc - the app parameters are ignored until the check passes
+static void begin_app_verify(void)
+{
+    memset(&app_info, 0, sizeof(app_info));
+    app_verify.in_progress = false;
+
+    app_info.shared_app_descriptor = shared_find_app_descriptor(_app_sec, get_app_sec_size());
+
+    const struct shared_app_descriptor_s* descriptor = app_info.shared_app_descriptor;
+
+    if (app_descriptor_valid(descriptor)) {
+        app_verify.in_progress = true;
+        app_verify.ofs = 0;
+        app_verify.crc64 = 0;
+    }
+}
+
+// runs the image crc check over at most max_len more bytes
+static void update_app_verify(uint32_t max_len)
+{
+    if (!app_verify.in_progress) {
+        return;
+    }
+
+    const struct shared_app_descriptor_s* descriptor = app_info.shared_app_descriptor;
+    uint32_t image_crc_ofs = (uint32_t)&descriptor->image_crc - (uint32_t)_app_sec;
+    uint32_t len = MIN(max_len, descriptor->image_size-app_verify.ofs);
+
+    PROFILE_ZONE_BEGIN(SHARED_BOOT_PROFILE_ZONE_APP_VERIFY);
+    app_verify.crc64 = image_crc64(&_app_sec[app_verify.ofs], len, app_verify.ofs, image_crc_ofs, app_verify.crc64);
+    app_verify.ofs += len;
+    PROFILE_ZONE_END(SHARED_BOOT_PROFILE_ZONE_APP_VERIFY);
+
+    if (app_verify.ofs < descriptor->image_size) {
+        return;
+    }
+
+    PROFILE_MILESTONE(SHARED_BOOT_PROFILE_MILESTONE_APP_VERIFIED);
+    app_verify.in_progress = false;
+    app_info.image_crc_computed = app_verify.crc64;
+    app_info.image_crc_correct = (app_info.image_crc_computed == descriptor->image_crc);
+
+    if (app_info.image_crc_correct) {
+        app_info.shared_app_parameters = shared_get_parameters(descriptor);
+        save_validated_image_record();
+    }
+}
+
 // call on change to flash memory
 static void update_app_info(void)
 {
+    begin_app_verify();
+    update_app_verify(UINT32_MAX);
+}
+
+// at power up the validation record stands in for the image crc check, as long as nothing has been programmed since
+// otherwise the check runs in the background from bootloader_update
+static void update_app_info_at_boot(void)
+{
+    struct validated_image_record_s record;
+    if (!persistent_store_read(PERSISTENT_STORE_KEY_VALIDATED_IMAGE, &record, sizeof(record)) || record.flash_generation != get_flash_generation()) {
+        begin_app_verify();
+        return;
+    }
+
     memset(&app_info, 0, sizeof(app_info));
 
     app_info.shared_app_descriptor = shared_find_app_descriptor(_app_sec, get_app_sec_size());
 
     const struct shared_app_descriptor_s* descriptor = app_info.shared_app_descriptor;
 
+    if (!app_header_valid() || !app_descriptor_valid(descriptor) || (uint32_t)descriptor - (uint32_t)_app_sec != record.descriptor_ofs ||
+        descriptor->image_size != record.image_size || descriptor->image_crc != record.image_crc) {
+        begin_app_verify();
+        return;
+    }
+
+    app_info.image_crc_computed = record.image_crc;
+    app_info.image_crc_correct = true;
+    app_info.shared_app_parameters = shared_get_parameters(descriptor);
+
+    uint8_t verify_interval = shared_get_image_verify_interval(descriptor, app_info.shared_app_parameters, BOARD_CONFIG_IMAGE_VERIFY_INTERVAL);
+    uint32_t boots_since_verify = persistent_store_counter_read(PERSISTENT_STORE_KEY_BOOT_COUNT) - record.boot_count;
+    if (verify_interval == 0 || boots_since_verify+1 >= verify_interval) {
+        // time for a full check
+        begin_app_verify();
+        return;
+    }
+
+    PROFILE_MILESTONE(SHARED_BOOT_PROFILE_MILESTONE_APP_VERIFIED);
+    // a tally bit, not a new validation record - the record is only rewritten by a full check
+    persistent_store_counter_increment(PERSISTENT_STORE_KEY_BOOT_COUNT);
+}
+
+// after a download the crc accumulated while writing stands in for reading the whole image back
+static void update_app_info_from_download(void)
+{
+#ifdef BOARD_CONFIG_PARANOID_IMAGE_VERIFY
+    update_app_info();
+#else
+    memset(&app_info, 0, sizeof(app_info));
 
-    if (descriptor && descriptor->image_size >= sizeof(struct shared_app_descriptor_s) && descriptor->image_size <= get_app_sec_size()) {
-        uint32_t pre_crc_len = ((uint32_t)&descriptor->image_crc) - ((uint32_t)_app_sec);
-        uint32_t post_crc_len = descriptor->image_size - pre_crc_len - sizeof(uint64_t);
-        uint8_t* pre_crc_origin = _app_sec;
-        uint8_t* post_crc_origin = (uint8_t*)((&descriptor->image_crc)+1);
-        uint64_t zero64 = 0;
+    app_info.shared_app_descriptor = shared_find_app_descriptor(_app_sec, get_app_sec_size());
 
-        app_info.image_crc_computed = crc64_we(pre_crc_origin, pre_crc_len, 0);
-        app_info.image_crc_computed = crc64_we((uint8_t*)&zero64, sizeof(zero64), app_info.image_crc_computed);
-        app_info.image_crc_computed = crc64_we(post_crc_origin, post_crc_len, app_info.image_crc_computed);
+    const struct shared_app_descriptor_s* descriptor = app_info.shared_app_descriptor;
 
-        app_info.image_crc_correct = (app_info.image_crc_computed == descriptor->image_crc);
+    if (!app_descriptor_valid(descriptor) || flash_state.image_crc_ofs == 0 ||
+        (const uint8_t*)&descriptor->image_crc != &_app_sec[flash_state.image_crc_ofs] || descriptor->image_size != flash_state.write_ofs) {
+        // not the image that was downloaded - check what is actually there
+        update_app_info();
+        return;
     }
 
+    app_info.image_crc_computed = flash_state.crc64;
+    app_info.image_crc_correct = (app_info.image_crc_computed == descriptor->image_crc);
+
     if (app_info.image_crc_correct) {
         app_info.shared_app_parameters = shared_get_parameters(descriptor);
+        save_validated_image_record();
     }
+#endif
 }
 
 static void corrupt_app(void) {
@@ -175,10 +508,79 @@ static void corrupt_app(void) {
 
 #ifdef BOARD_CONFIG_HERE_LEDS
 static void here_led_disable(void);
+#if BOARD_CONFIG_BOOT_DIRECT_JUMP
+static void here_led_deinit(void);
+#endif
+#endif
+
+static void boot_app(enum shared_msg_t boot_msgid, const union shared_msg_payload_u* boot_msg);
+
+#if BOARD_CONFIG_BOOT_DIRECT_JUMP
+static const struct {
+    enum rcc_periph_clken clken;
+    enum rcc_periph_rst rst;
+} gpio_ports[] = {
+    { RCC_GPIOA, RST_GPIOA }, { RCC_GPIOB, RST_GPIOB }, { RCC_GPIOC, RST_GPIOC },
+    { RCC_GPIOD, RST_GPIOD }, { RCC_GPIOE, RST_GPIOE }, { RCC_GPIOF, RST_GPIOF },
+};
+
+// the ports holding the CAN pins and the board's LED and boot trigger pins
+static bool gpio_port_used(enum rcc_periph_clken clken)
+{
+    if (clken == BOARD_CONFIG_CAN_RX_GPIO_PORT_RCC || clken == BOARD_CONFIG_CAN_TX_GPIO_PORT_RCC) {
+        return true;
+    }
+#ifdef BOARD_CONFIG_HERE_LEDS
+    if (clken == RCC_GPIOA || clken == RCC_GPIOB) {
+        return true;
+    }
+#endif
+#ifdef BOARD_CONFIG_I2C_BOOT_TRIGGER
+    if (clken == RCC_GPIOA) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+// undoes bootloader_init, leaving the chip as the app would find it after a reset
+static void deinit_peripherals(void)
+{
+    // let a queued flash job or persistent store write finish
+    while (!flash_async_idle());
+
+    cm_disable_interrupts();
+
+    canbus_deinit();
+#ifdef BOARD_CONFIG_HERE_LEDS
+    here_led_deinit();
+#endif
+    timing_deinit();
+
+    for (uint8_t i=0; i<sizeof(gpio_ports)/sizeof(gpio_ports[0]); i++) {
+        if (gpio_port_used(gpio_ports[i].clken)) {
+            rcc_periph_reset_pulse(gpio_ports[i].rst);
+            rcc_periph_clock_disable(gpio_ports[i].clken);
+        }
+    }
+
+    deinit_clock();
+
+    for (uint8_t i=0; i<8; i++) {
+        NVIC_ICER(i) = 0xFFFFFFFF;
+        NVIC_ICPR(i) = 0xFFFFFFFF;
+    }
+    SCB_ICSR = SCB_ICSR_PENDSTCLR;
+
+    cm_enable_interrupts();
+}
 #endif
 
 static void command_boot_if_app_valid(uint8_t boot_reason)
 {
+    // finish a check still running in the background
+    update_app_verify(UINT32_MAX);
+
     if (!app_info.image_crc_correct) {
         return;
     }
@@ -195,27 +597,43 @@ static void command_boot_if_app_valid(uint8_t boot_reason)
         msg.boot_msg.canbus_info.baudrate = 0;
     }
 
-    shared_msg_finalize_and_write(SHARED_MSG_BOOT, &msg);
+    enum shared_msg_t boot_msgid = SHARED_MSG_BOOT;
+#ifdef BOARD_CONFIG_PROFILING
+    PROFILE_MILESTONE(SHARED_BOOT_PROFILE_MILESTONE_BOOT_COMMANDED);
+    msg.boot_profiled_msg.profile = *profile_get();
+    boot_msgid = SHARED_MSG_BOOT_PROFILED;
+#endif
 
 #ifdef BOARD_CONFIG_HERE_LEDS
     here_led_disable();
 #endif
 
+#if BOARD_CONFIG_BOOT_DIRECT_JUMP
+    deinit_peripherals();
+    boot_app(boot_msgid, &msg);
+#else
+    shared_msg_finalize_and_write(boot_msgid, &msg);
     scb_reset_system();
+#endif
 }
 
-static void boot_app_if_commanded(void)
+// hands the app its BOOT_INFO message and jumps to it, does not return
+static void boot_app(enum shared_msg_t boot_msgid, const union shared_msg_payload_u* boot_msg)
 {
-    if (!shared_msg_valid || shared_msgid != SHARED_MSG_BOOT) {
-        return;
-    }
-
     union shared_msg_payload_u msg;
-    msg.canbus_info = shared_msg.canbus_info;
-    msg.boot_info_msg.boot_reason = shared_msg.boot_msg.boot_reason;
+    msg.canbus_info = boot_msg->canbus_info;
+    msg.boot_info_msg.boot_reason = boot_msg->boot_msg.boot_reason;
     msg.boot_info_msg.hw_info = &_hw_info;
 
-    shared_msg_finalize_and_write(SHARED_MSG_BOOT_INFO, &msg);
+    if (boot_msgid == SHARED_MSG_BOOT_PROFILED) {
+        msg.boot_info_profiled_msg.profile = boot_msg->boot_profiled_msg.profile;
+#ifdef BOARD_CONFIG_PROFILING
+        msg.boot_info_profiled_msg.profile.milestone_cycles[SHARED_BOOT_PROFILE_MILESTONE_APP_JUMP] = DWT_CYCCNT;
+#endif
+        shared_msg_finalize_and_write(SHARED_MSG_BOOT_INFO_PROFILED, &msg);
+    } else {
+        shared_msg_finalize_and_write(SHARED_MSG_BOOT_INFO, &msg);
+    }
 
     struct app_header_s* app_header = (struct app_header_s*)_app_sec;
 
@@ -228,9 +646,17 @@ static void boot_app_if_commanded(void)
         : : "r"(app_header->stacktop), "r"(app_header->entrypoint) :);
 }
 
+static void boot_app_if_commanded(void)
+{
+    if (!shared_msg_valid || (shared_msgid != SHARED_MSG_BOOT && shared_msgid != SHARED_MSG_BOOT_PROFILED)) {
+        return;
+    }
+
+    boot_app(shared_msgid, &shared_msg);
+}
+
 static void erase_app_page(uint32_t page_num) {
-    flash_erase_page(&_app_sec[page_num*APP_PAGE_SIZE]);
-    flash_state.last_erased_page = page_num;
+    flash_async_erase_page(&_app_sec[page_num*APP_PAGE_SIZE]);
 }
 
 static void restart_request_handler(struct uavcan_transfer_info_s transfer_info, uint64_t magic) {
@@ -250,34 +676,181 @@ static void restart_request_handler(struct uavcan_transfer_info_s transfer_info,
     }
 }
 
-static void do_resend_read_request(void) {
-    flash_state.transfer_id = uavcan_send_file_read_request(flash_state.source_node_id, flash_state.ofs, flash_state.path);
-    flash_state.last_req_ms = millis();
-    flash_state.retries++;
+static struct file_read_slot_s* get_file_read_slot(uint32_t ofs) {
+    return &flash_state.slots[(ofs/FILE_READ_CHUNK_SIZE)%BOARD_CONFIG_FILE_READ_WINDOW_SIZE];
+}
+
+static void do_resend_read_request(struct file_read_slot_s* slot) {
+    const char* path = flash_state.path;
+#if BOARD_CONFIG_DELTA_UPDATE
+    char manifest_path[sizeof(flash_state.path)];
+    if (flash_state.fetching_manifest) {
+        strcpy(manifest_path, flash_state.path);
+        strcat(manifest_path, DELTA_MANIFEST_SUFFIX);
+        path = manifest_path;
+    }
+#endif
+    slot->transfer_id = uavcan_send_file_read_request(flash_state.source_node_id, slot->ofs, path);
+    slot->last_req_ms = millis();
+    slot->retries++;
+}
+
+static void do_send_read_request(struct file_read_slot_s* slot, uint32_t ofs) {
+    slot->active = true;
+    slot->received = false;
+    slot->ofs = ofs;
+    do_resend_read_request(slot);
+    slot->retries = 0;
 }
 
-static void do_send_read_request(void) {
-    do_resend_read_request();
-    flash_state.retries = 0;
+// issue requests until every slot of the window is in flight
+static bool page_skipped(uint32_t page_num) {
+    return page_num < 64 && (flash_state.skip_page_mask & (1ULL<<page_num));
 }
 
+static void fill_read_request_window(void) {
+#if BOARD_CONFIG_DELTA_UPDATE
+    if (flash_state.fetching_manifest) {
+        struct file_read_slot_s* slot = get_file_read_slot(0);
+        if (!slot->active) {
+            do_send_read_request(slot, 0);
+        }
+        return;
+    }
+#endif
+
+    while (flash_state.req_ofs <= get_app_sec_size() && (!flash_state.eof_received || flash_state.req_ofs <= flash_state.eof_ofs)) {
+        struct file_read_slot_s* slot = get_file_read_slot(flash_state.req_ofs);
+        if (slot->active) {
+            return;
+        }
+
+        do_send_read_request(slot, flash_state.req_ofs);
+        flash_state.req_ofs += FILE_READ_CHUNK_SIZE;
+        while (page_skipped(flash_state.req_ofs/APP_PAGE_SIZE)) {
+            flash_state.req_ofs += APP_PAGE_SIZE;
+        }
+    }
+}
+
+// the app header of the new image has not been programmed yet, so flash is left as is for a later resume
 static void do_fail_update(void) {
+    flash_async_abort();
     memset(&flash_state, 0, sizeof(flash_state));
-    corrupt_app();
+    update_app_info();
+}
+
+static void do_fail_update_image_too_large(void) {
+    uavcan_send_debug_logmessage(UAVCAN_LOGLEVEL_ERROR, "bl", "image larger than the app region");
+    do_fail_update();
 }
 
-static void begin_flash_from_path(uint8_t source_node_id, const char* path)
+static void save_update_progress(uint32_t committed_ofs, uint64_t crc64, uint32_t image_crc_ofs) {
+    union shared_msg_payload_u msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.update_progress_msg.canbus_info.baudrate = canbus_get_baudrate();
+    msg.update_progress_msg.canbus_info.local_node_id = uavcan_get_node_id();
+    msg.update_progress_msg.source_node_id = flash_state.source_node_id;
+    msg.update_progress_msg.path_hash = flash_state.path_hash;
+    msg.update_progress_msg.committed_ofs = committed_ofs;
+    msg.update_progress_msg.crc64 = crc64;
+    msg.update_progress_msg.image_crc_ofs = image_crc_ofs;
+    memcpy(msg.update_progress_msg.app_header, flash_state.app_header, sizeof(flash_state.app_header));
+
+    shared_msg_finalize_and_write(SHARED_MSG_UPDATE_PROGRESS, &msg);
+
+    update_progress = msg.update_progress_msg;
+    update_progress_valid = true;
+}
+
+// checks that flash still holds what the progress record describes
+static bool update_progress_resumable(uint8_t source_node_id, uint64_t path_hash) {
+    if (!update_progress_valid || update_progress.source_node_id != source_node_id || update_progress.path_hash != path_hash) {
+        return false;
+    }
+
+    const uint32_t header_len = sizeof(update_progress.app_header);
+    if (update_progress.committed_ofs < header_len || update_progress.committed_ofs % APP_PAGE_SIZE != 0 || update_progress.committed_ofs >= get_app_sec_size()) {
+        return false;
+    }
+
+    if (update_progress.image_crc_ofs != 0 && update_progress.image_crc_ofs < header_len) {
+        return false;
+    }
+
+    uint64_t crc64 = image_crc64(update_progress.app_header, header_len, 0, update_progress.image_crc_ofs, 0);
+    crc64 = image_crc64(&_app_sec[header_len], update_progress.committed_ofs-header_len, header_len, update_progress.image_crc_ofs, crc64);
+    return crc64 == update_progress.crc64;
+}
+
+
+#if BOARD_CONFIG_DELTA_UPDATE
+// marks the pages whose crc32 in the manifest matches flash - a missing or unusable manifest means a full update
+static void begin_delta_from_manifest(const uint8_t* manifest, uint16_t manifest_len)
+{
+    flash_state.fetching_manifest = false;
+    get_file_read_slot(0)->active = false;
+
+    struct delta_manifest_header_s header;
+    if (manifest && manifest_len >= sizeof(header)) {
+        memcpy(&header, manifest, sizeof(header));
+        uint32_t num_pages = (header.image_size+APP_PAGE_SIZE-1)/APP_PAGE_SIZE;
+
+        if (header.magic == DELTA_MANIFEST_MAGIC && header.page_size == APP_PAGE_SIZE && header.num_pages == num_pages &&
+            num_pages <= 64 && header.image_size <= get_app_sec_size() && manifest_len >= sizeof(header)+num_pages*sizeof(uint32_t)) {
+            flash_state.delta = true;
+
+            // the first page holds the corrupted app header and the last page ends the file, both are always fetched
+            for (uint32_t i=1; i+1<num_pages; i++) {
+                uint32_t page_crc;
+                memcpy(&page_crc, &manifest[sizeof(header)+i*sizeof(uint32_t)], sizeof(page_crc));
+                if (crc32(&_app_sec[i*APP_PAGE_SIZE], APP_PAGE_SIZE, 0) == page_crc) {
+                    flash_state.skip_page_mask |= 1ULL<<i;
+                }
+            }
+        }
+    }
+
+    fill_read_request_window();
+}
+#endif
+
+// returns false without touching flash if the validation record could not be invalidated
+static bool begin_flash_from_path(uint8_t source_node_id, const char* path)
 {
+    if (!bump_flash_generation()) {
+        return false;
+    }
+
     boot_timer_state.enable = false;
     memset(&flash_state, 0, sizeof(flash_state));
     flash_state.in_progress = true;
-    flash_state.ofs = 0;
     flash_state.source_node_id = source_node_id;
     strncpy(flash_state.path, path, 200);
-    flash_state.transfer_id = uavcan_send_file_read_request(flash_state.source_node_id, flash_state.ofs, flash_state.path);
-    flash_state.last_req_ms = millis();
+    flash_state.path_hash = hash_fnv_1a(strlen(flash_state.path), (const uint8_t*)flash_state.path);
+
+    if (update_progress_resumable(source_node_id, flash_state.path_hash)) {
+        // pick up after the last fully programmed page
+        flash_state.ofs = update_progress.committed_ofs;
+        flash_state.write_ofs = update_progress.committed_ofs;
+        flash_state.req_ofs = update_progress.committed_ofs;
+        flash_state.crc64 = update_progress.crc64;
+        flash_state.image_crc_ofs = update_progress.image_crc_ofs;
+        memcpy(flash_state.app_header, update_progress.app_header, sizeof(flash_state.app_header));
+        fill_read_request_window();
+        return true;
+    }
+
+    flash_state.ofs = 0;
+    flash_state.write_ofs = 0;
+    flash_state.req_ofs = 0;
+    memset(flash_state.app_header, 0xff, sizeof(flash_state.app_header));
+#if BOARD_CONFIG_DELTA_UPDATE
+    flash_state.fetching_manifest = !delta_update_disabled && strlen(flash_state.path)+strlen(DELTA_MANIFEST_SUFFIX) < sizeof(flash_state.path);
+#endif
+    fill_read_request_window();
     corrupt_app();
-    flash_state.last_erased_page = -1;
+    return true;
 }
 
 // static void concat_int64_hex(char* dest, uint64_t val) {
@@ -288,45 +861,370 @@ static void begin_flash_from_path(uint8_t source_node_id, const char* path)
 // }
 
 static void uavcan_ready_handler(void) {
+    PROFILE_MILESTONE(SHARED_BOOT_PROFILE_MILESTONE_NODE_ID_ASSIGNED);
     canbus_init(canbus_get_baudrate(), false, true);
 
-    if (shared_msg_valid && shared_msgid == SHARED_MSG_FIRMWAREUPDATE) {
-        begin_flash_from_path(shared_msg.firmwareupdate_msg.source_node_id, shared_msg.firmwareupdate_msg.path);
-    } else {
+    uint32_t allocation_time_us = uavcan_get_node_id_allocation_time_us();
+    if (allocation_time_us != 0) {
+        // ask for the same ID next boot
+        uint8_t node_id = uavcan_get_node_id();
+        persistent_store_write(PERSISTENT_STORE_KEY_PREFERRED_NODE_ID, &node_id, sizeof(node_id));
+        uavcan_send_debug_key_value("uavcan.id_ms", allocation_time_us/1000.0f);
+    }
+
+    if (!shared_msg_valid || shared_msgid != SHARED_MSG_FIRMWAREUPDATE ||
+        !begin_flash_from_path(shared_msg.firmwareupdate_msg.source_node_id, shared_msg.firmwareupdate_msg.path)) {
         check_and_start_boot_timer();
     }
 }
 
 static void on_update_complete(void) {
     flash_state.in_progress = false;
-    update_app_info();
+
+    for (uint8_t i=0; i<sizeof(flash_state.app_header); i+=sizeof(uint16_t)) {
+        flash_program_half_word((uint16_t*)&_app_sec[i], (uint16_t*)&flash_state.app_header[i]);
+    }
+
+    update_progress_valid = false;
+    shared_msg_clear();
+
+    update_app_info_from_download();
     command_boot_if_app_valid(SHARED_BOOT_REASON_FIRMWARE_UPDATE);
+
+    // still here, the image did not check out - the main loop sends these
+    uavcan_send_debug_key_value("fw.pg_skip", flash_write_stats.pages_skipped);
+    uavcan_send_debug_key_value("fw.hw_skip", flash_write_stats.half_words_skipped);
+
+    if (flash_state.delta) {
+        // the manifest did not match the image, fall back to full updates
+        delta_update_disabled = true;
+    }
 }
 
-static void file_read_response_handler(uint8_t transfer_id, int16_t error, const uint8_t* data, uint16_t data_len, bool eof)
+// adds len bytes at write_ofs to the running image crc
+static void image_crc_update(const uint8_t* data, uint32_t len)
 {
-    if (flash_state.in_progress && transfer_id == flash_state.transfer_id) {
-        if (error != 0 || flash_state.ofs+data_len > get_app_sec_size()) {
-            do_fail_update();
+    const uint8_t* signature = (const uint8_t*)SHARED_APP_DESCRIPTOR_SIGNATURE;
+
+    // the first descriptor signature in the image is the one shared_find_app_descriptor finds
+    for (uint32_t i=0; i<len && flash_state.image_crc_ofs == 0; i++) {
+        if (data[i] == signature[flash_state.descriptor_sig_matched]) {
+            flash_state.descriptor_sig_matched++;
+        } else {
+            flash_state.descriptor_sig_matched = (data[i] == signature[0]) ? 1 : 0;
+        }
+
+        // the descriptor is aligned(8), so is the field after the signature
+        if (flash_state.descriptor_sig_matched == sizeof(SHARED_APP_DESCRIPTOR_SIGNATURE)-1 && (flash_state.write_ofs+i+1) % sizeof(uint64_t) == 0) {
+            flash_state.image_crc_ofs = flash_state.write_ofs+i+1;
+        }
+    }
+
+    flash_state.crc64 = image_crc64(data, len, flash_state.write_ofs, flash_state.image_crc_ofs, flash_state.crc64);
+}
+
+// true if len more image bytes can be taken without waiting for the flash
+static bool page_buf_can_accept(uint16_t len)
+{
+    const struct page_buf_s* buf = &flash_state.page_bufs[flash_state.page_buf_idx];
+    const struct page_buf_s* next_buf = &flash_state.page_bufs[(flash_state.page_buf_idx+1) % 2];
+
+    if (len == 0) {
+        return true;
+    }
+
+    if (flash_state.page_buf_len == 0 && !flash_async_job_done(buf->flash_job_id)) {
+        return false;
+    }
+
+    if (flash_state.page_buf_len+len >= APP_PAGE_SIZE) {
+        // completes the page - room for its erase and program jobs is needed
+        if (!flash_async_can_submit(2)) {
+            return false;
+        }
+
+        if (flash_state.page_buf_len+len > APP_PAGE_SIZE && !flash_async_job_done(next_buf->flash_job_id)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// writes the current page buffer out unless flash already holds the same bytes
+static void flush_page_buf(void)
+{
+    struct page_buf_s* buf = &flash_state.page_bufs[flash_state.page_buf_idx];
+    uint32_t page_ofs = flash_state.write_ofs-flash_state.page_buf_len;
+
+    if (memcmp(buf->data, &_app_sec[page_ofs], flash_state.page_buf_len) == 0) {
+        flash_write_stats.pages_skipped++;
+        buf->flash_job_id = 0;
+    } else {
+        for (uint16_t i=0; i<flash_state.page_buf_len; i+=sizeof(uint16_t)) {
+            if (*(uint16_t*)&buf->data[i] == 0xFFFF) {
+                flash_write_stats.half_words_skipped++;
+            }
+        }
+
+        erase_app_page(page_ofs/APP_PAGE_SIZE);
+        buf->flash_job_id = write_data_to_flash(page_ofs, buf->data, flash_state.page_buf_len);
+        flash_state.last_flash_job_id = buf->flash_job_id;
+    }
+
+    flash_state.page_buf_len = 0;
+    flash_state.page_buf_idx = (flash_state.page_buf_idx+1) % 2;
+
+    // a compressed stream can not be picked up in the middle, so only plain images record progress
+    if (!flash_state.compressed && flash_state.write_ofs % APP_PAGE_SIZE == 0) {
+        // the page is complete once its job is done
+        flash_state.progress_pending = true;
+        flash_state.progress_ofs = flash_state.write_ofs;
+        flash_state.progress_crc64 = flash_state.crc64;
+        flash_state.progress_image_crc_ofs = flash_state.image_crc_ofs;
+        flash_state.progress_flash_job_id = flash_state.last_flash_job_id;
+    }
+}
+
+// copies image bytes at write_ofs into the page buffers, returns false without doing anything if they are busy
+static bool commit_image_bytes(const uint8_t* data, uint16_t len)
+{
+    if (!page_buf_can_accept(len)) {
+        return false;
+    }
+
+    while (len > 0) {
+        struct page_buf_s* buf = &flash_state.page_bufs[flash_state.page_buf_idx];
+        uint16_t n = MIN(len, APP_PAGE_SIZE-flash_state.page_buf_len);
+        memcpy(&buf->data[flash_state.page_buf_len], data, n);
+
+        if (flash_state.write_ofs < sizeof(flash_state.app_header)) {
+            uint16_t header_len = MIN(sizeof(flash_state.app_header)-flash_state.write_ofs, n);
+            memcpy(&flash_state.app_header[flash_state.write_ofs], data, header_len);
+            // left erased, the header is programmed once the whole image is in flash
+            memset(&buf->data[flash_state.page_buf_len], 0xff, header_len);
+        }
+
+        image_crc_update(data, n);
+        flash_state.write_ofs += n;
+        flash_state.page_buf_len += n;
+        data += n;
+        len -= n;
+
+        if (flash_state.page_buf_len == APP_PAGE_SIZE) {
+            flush_page_buf();
+        }
+    }
+
+    return true;
+}
+
+#if BOARD_CONFIG_COMPRESSED_UPDATE
+// switches to decompression if the first chunk of the file starts with a compressed image header
+static void check_compressed_image_header(const struct file_read_slot_s* slot)
+{
+    struct compressed_image_header_s header;
+    if (slot->data_len < sizeof(header)) {
+        return;
+    }
+
+    memcpy(&header, slot->data, sizeof(header));
+    if (header.magic != COMPRESSED_IMAGE_MAGIC) {
+        return;
+    }
+
+    if (header.image_size > get_app_sec_size()) {
+        do_fail_update_image_too_large();
+        return;
+    }
+
+    if (header.image_size <= sizeof(flash_state.app_header)) {
+        do_fail_update();
+        return;
+    }
+
+    // the manifest describes file pages, which no longer line up with the image once it is compressed
+    if (flash_state.skip_page_mask & ((1ULL<<(flash_state.req_ofs/APP_PAGE_SIZE))-1)) {
+        // requests already went out past skipped pages - keep this first chunk and fetch the rest of the file in full
+        for (uint8_t i=0; i<BOARD_CONFIG_FILE_READ_WINDOW_SIZE; i++) {
+            if (&flash_state.slots[i] != slot) {
+                flash_state.slots[i].active = false;
+            }
+        }
+        flash_state.req_ofs = FILE_READ_CHUNK_SIZE;
+    }
+    flash_state.delta = false;
+
+    flash_state.compressed = true;
+    flash_state.skip_page_mask = 0;
+    flash_state.image_size = header.image_size;
+    flash_state.in_consumed = sizeof(header);
+    lzss_decoder_init(&flash_state.lzss);
+}
+
+// feeds the slot to the decoder, returns true once all of it has been consumed
+static bool decompress_slot(struct file_read_slot_s* slot)
+{
+    uint8_t out[64];
+
+    while (true) {
+        uint32_t out_len = MIN(sizeof(out), flash_state.image_size-flash_state.write_ofs);
+        if (!page_buf_can_accept(out_len)) {
+            return false;
+        }
+
+        uint32_t in_len = slot->data_len-flash_state.in_consumed;
+        out_len = lzss_decode(&flash_state.lzss, &slot->data[flash_state.in_consumed], &in_len, out, out_len);
+        flash_state.in_consumed += in_len;
+        commit_image_bytes(out, out_len);
+
+        // anything following the end of the image is ignored
+        if (flash_state.in_consumed == slot->data_len || flash_state.write_ofs == flash_state.image_size) {
+            flash_state.in_consumed = 0;
+            return true;
+        }
+    }
+}
+#endif
+
+// pass received chunks on to the page buffers in order - slots are released as soon as they are copied
+static void commit_received_chunks(void)
+{
+    while (flash_state.in_progress && !flash_state.eof_committed) {
+        if (!flash_state.compressed && page_skipped(flash_state.ofs/APP_PAGE_SIZE)) {
+            // already in flash, only the running crc moves on
+            image_crc_update(&_app_sec[flash_state.write_ofs], APP_PAGE_SIZE);
+            flash_state.ofs += APP_PAGE_SIZE;
+            flash_state.write_ofs += APP_PAGE_SIZE;
+            flash_state.progress_pending = true;
+            flash_state.progress_ofs = flash_state.write_ofs;
+            flash_state.progress_crc64 = flash_state.crc64;
+            flash_state.progress_image_crc_ofs = flash_state.image_crc_ofs;
+            flash_state.progress_flash_job_id = flash_state.last_flash_job_id;
+            continue;
+        }
+
+        struct file_read_slot_s* slot = get_file_read_slot(flash_state.ofs);
+        if (!slot->active || !slot->received || slot->ofs != flash_state.ofs) {
             return;
         }
 
-        int32_t curr_page = (flash_state.ofs+data_len)/APP_PAGE_SIZE;
-        if (curr_page > flash_state.last_erased_page) {
-            for (int32_t i=flash_state.last_erased_page+1; i<=curr_page; i++) {
-                erase_app_page(i);
+#if BOARD_CONFIG_COMPRESSED_UPDATE
+        if (flash_state.ofs == 0 && !flash_state.compressed) {
+            check_compressed_image_header(slot);
+            if (!flash_state.in_progress) {
+                return;
             }
         }
 
-        write_data_to_flash(flash_state.ofs, data, data_len);
+        if (flash_state.compressed) {
+            if (!decompress_slot(slot)) {
+                return;
+            }
+        } else
+#endif
+        if (!commit_image_bytes(slot->data, slot->data_len)) {
+            return;
+        }
+        // the data has been copied to the page buffers
+        slot->active = false;
+
+        if (slot->eof) {
+            flash_state.eof_committed = true;
+            return;
+        }
+
+        flash_state.ofs += slot->data_len;
+    }
+}
+
+static void update_flash_from_file(void)
+{
+    if (flash_async_error()) {
+        do_fail_update();
+        return;
+    }
+
+    if (flash_state.progress_pending && flash_async_job_done(flash_state.progress_flash_job_id)) {
+        flash_state.progress_pending = false;
+        save_update_progress(flash_state.progress_ofs, flash_state.progress_crc64, flash_state.progress_image_crc_ofs);
+    }
 
-        if (eof) {
+    if (flash_state.eof_committed) {
+        if (flash_state.compressed && flash_state.write_ofs != flash_state.image_size) {
+            // the stream ended early
+            do_fail_update();
+        } else if (flash_state.page_buf_len > 0) {
+            // the last page is partial
+            if (flash_async_can_submit(2)) {
+                flush_page_buf();
+            }
+        } else if (flash_async_idle()) {
             on_update_complete();
-        } else {
-            flash_state.ofs += data_len;
-            do_send_read_request();
+        }
+        return;
+    }
+
+    commit_received_chunks();
+    fill_read_request_window();
+}
+
+static void file_read_response_handler(uint8_t transfer_id, int16_t error, const struct uavcan_rx_payload_s* data, uint16_t data_len, bool eof)
+{
+    if (!flash_state.in_progress) {
+        return;
+    }
+
+    struct file_read_slot_s* slot = NULL;
+    for (uint8_t i=0; i<BOARD_CONFIG_FILE_READ_WINDOW_SIZE; i++) {
+        if (flash_state.slots[i].active && !flash_state.slots[i].received && flash_state.slots[i].transfer_id == transfer_id) {
+            slot = &flash_state.slots[i];
+            break;
+        }
+    }
+
+    if (!slot) {
+        return;
+    }
+
+#if BOARD_CONFIG_DELTA_UPDATE
+    if (flash_state.fetching_manifest) {
+        // begin_delta_from_manifest only releases the slot, its buffer stays intact
+        uint16_t manifest_len = MIN(data_len, sizeof(slot->data));
+        uavcan_rx_payload_copy(data, slot->data, manifest_len);
+        begin_delta_from_manifest(error == 0 ? slot->data : NULL, manifest_len);
+        return;
+    }
+#endif
+
+    if (error != 0 || data_len > FILE_READ_CHUNK_SIZE) {
+        do_fail_update();
+        return;
+    }
+
+    if (slot->ofs+data_len > get_app_sec_size()) {
+        do_fail_update_image_too_large();
+        return;
+    }
+
+    uavcan_rx_payload_copy(data, slot->data, data_len);
+    slot->data_len = data_len;
+    slot->eof = eof;
+    slot->received = true;
+
+    if (eof && (!flash_state.eof_received || slot->ofs < flash_state.eof_ofs)) {
+        flash_state.eof_received = true;
+        flash_state.eof_ofs = slot->ofs;
+
+        // requests past the end of the file are no longer needed
+        for (uint8_t i=0; i<BOARD_CONFIG_FILE_READ_WINDOW_SIZE; i++) {
+            if (flash_state.slots[i].ofs > flash_state.eof_ofs) {
+                flash_state.slots[i].active = false;
+            }
         }
     }
+
+    update_flash_from_file();
 }
 
 static void file_beginfirmwareupdate_handler(struct uavcan_transfer_info_s transfer_info, uint8_t source_node_id, const char* path)
@@ -336,8 +1234,11 @@ static void file_beginfirmwareupdate_handler(struct uavcan_transfer_info_s trans
             source_node_id = transfer_info.remote_node_id;
         }
 
-        uavcan_send_file_beginfirmwareupdate_response(&transfer_info, UAVCAN_BEGINFIRMWAREUPDATE_ERROR_OK, "");
-        begin_flash_from_path(source_node_id, path);
+        if (begin_flash_from_path(source_node_id, path)) {
+            uavcan_send_file_beginfirmwareupdate_response(&transfer_info, UAVCAN_BEGINFIRMWAREUPDATE_ERROR_OK, "");
+        } else {
+            uavcan_send_file_beginfirmwareupdate_response(&transfer_info, UAVCAN_BEGINFIRMWAREUPDATE_ERROR_UNKNOWN, "store write failed");
+        }
     } else {
         uavcan_send_file_beginfirmwareupdate_response(&transfer_info, UAVCAN_BEGINFIRMWAREUPDATE_ERROR_IN_PROGRESS, "");
     }
@@ -349,15 +1250,6 @@ static struct canbus_autobaud_state_s autobaud_state;
 static void on_canbus_baudrate_confirmed(uint32_t canbus_baud);
 
 static void begin_canbus_autobaud(void) {
-    uint32_t canbus_baud;
-    if (shared_msg_valid && canbus_baudrate_valid(shared_msg.canbus_info.baudrate)) {
-        canbus_baud = shared_msg.canbus_info.baudrate;
-    } else if (app_info.shared_app_parameters && canbus_baudrate_valid(app_info.shared_app_parameters->canbus_baudrate)) {
-        canbus_baud = app_info.shared_app_parameters->canbus_baudrate;
-    } else {
-        canbus_baud = 1000000;
-    }
-
     bool canbus_autobaud_enable;
     if (shared_msg_valid && canbus_baudrate_valid(shared_msg.canbus_info.baudrate)) {
         canbus_autobaud_enable = false;
@@ -367,6 +1259,23 @@ static void begin_canbus_autobaud(void) {
         canbus_autobaud_enable = true;
     }
 
+    // rate autobaud last settled on - only a starting point for autobaud, a rate set by the app wins
+    uint32_t saved_canbus_baud = 0;
+    if (canbus_autobaud_enable) {
+        persistent_store_read(PERSISTENT_STORE_KEY_CANBUS_BAUDRATE, &saved_canbus_baud, sizeof(saved_canbus_baud));
+    }
+
+    uint32_t canbus_baud;
+    if (shared_msg_valid && canbus_baudrate_valid(shared_msg.canbus_info.baudrate)) {
+        canbus_baud = shared_msg.canbus_info.baudrate;
+    } else if (app_info.shared_app_parameters && canbus_baudrate_valid(app_info.shared_app_parameters->canbus_baudrate)) {
+        canbus_baud = app_info.shared_app_parameters->canbus_baudrate;
+    } else if (canbus_baudrate_valid(saved_canbus_baud)) {
+        canbus_baud = saved_canbus_baud;
+    } else {
+        canbus_baud = 1000000;
+    }
+
     if (canbus_autobaud_enable) {
         canbus_autobaud_start(&autobaud_state, canbus_baud, CANBUS_AUTOBAUD_SWITCH_INTERVAL_US);
         canbus_autobaud_running = true;
@@ -382,6 +1291,8 @@ static void update_canbus_autobaud(void) {
 
     uint32_t canbus_baud = canbus_autobaud_update(&autobaud_state);
     if (autobaud_state.success) {
+        // identical records are not rewritten
+        persistent_store_write(PERSISTENT_STORE_KEY_CANBUS_BAUDRATE, &canbus_baud, sizeof(canbus_baud));
         on_canbus_baudrate_confirmed(canbus_baud);
         canbus_autobaud_running = false;
     }
@@ -389,6 +1300,7 @@ static void update_canbus_autobaud(void) {
 }
 
 static void on_canbus_baudrate_confirmed(uint32_t canbus_baud) {
+    PROFILE_MILESTONE(SHARED_BOOT_PROFILE_MILESTONE_BAUD_CONFIRMED);
     canbus_init(canbus_baud, false, false);
     canbus_initialized = true;
     uavcan_init();
@@ -403,6 +1315,10 @@ static void on_canbus_baudrate_confirmed(uint32_t canbus_baud) {
         uavcan_set_node_id(shared_msg.canbus_info.local_node_id);
     } else if (app_info.shared_app_parameters && app_info.shared_app_parameters->canbus_local_node_id > 0 && app_info.shared_app_parameters->canbus_local_node_id <= 127) {
         uavcan_set_node_id(app_info.shared_app_parameters->canbus_local_node_id);
+    } else {
+        uint8_t preferred_node_id = 0;
+        persistent_store_read(PERSISTENT_STORE_KEY_PREFERRED_NODE_ID, &preferred_node_id, sizeof(preferred_node_id));
+        uavcan_set_preferred_node_id(preferred_node_id);
     }
 }
 
@@ -463,6 +1379,15 @@ static void here_led_update(void) {
     profiLED_gen_write(4, colors, led_spi_send_byte);
 }
 
+#if BOARD_CONFIG_BOOT_DIRECT_JUMP
+static void here_led_deinit(void) {
+    while (SPI_SR(SPI3) & SPI_SR_BSY);
+    spi_disable(SPI3);
+    rcc_periph_reset_pulse(RST_SPI3);
+    rcc_periph_clock_disable(RCC_SPI3);
+}
+#endif
+
 static void here_led_init(void) {
     rcc_periph_clock_enable(RCC_SPI3);
     rcc_periph_clock_enable(RCC_GPIOA);
@@ -498,19 +1423,91 @@ static void here_led_init(void) {
 
 #endif
 
+#if BOARD_CONFIG_CAN_STATS_PUBLISH_INTERVAL_MS
+static void publish_can_stats_next(void)
+{
+    static const char* const keys[] = {
+        "can.tx", "can.rx", "can.txb", "can.rxb", "can.ovr", "can.abrt", "can.boff", "can.err", "can.tec", "can.rec"
+    };
+    static uint8_t next_key;
+
+    struct canbus_stats_s stats;
+    canbus_get_stats(&stats);
+
+    const uint32_t values[] = {
+        stats.frames_tx, stats.frames_rx, stats.bytes_tx, stats.bytes_rx, stats.rx_overruns,
+        stats.tx_aborts, stats.bus_off_events, stats.errors, stats.tec, stats.rec
+    };
+
+    uavcan_send_debug_key_value(keys[next_key], values[next_key]);
+    next_key = (next_key+1) % (sizeof(keys)/sizeof(keys[0]));
+}
+#endif
+
 static void bootloader_pre_init(void)
 {
+#ifdef BOARD_CONFIG_PROFILING
+    profile_init();
+#endif
+    PROFILE_ZONE_BEGIN(SHARED_BOOT_PROFILE_ZONE_PRE_INIT);
+
     // check for a valid shared message, jump immediately if it is a boot command
     shared_msg_valid = shared_msg_check_and_retreive(&shared_msgid, &shared_msg);
     shared_msg_clear();
 
+    if (shared_msg_valid && shared_msgid == SHARED_MSG_UPDATE_PROGRESS) {
+        // keep the record in the mailbox in case we are reset again before the update is resumed
+        update_progress = shared_msg.update_progress_msg;
+        update_progress_valid = true;
+        shared_msg_finalize_and_write(SHARED_MSG_UPDATE_PROGRESS, &shared_msg);
+    }
+
+    PROFILE_ZONE_END(SHARED_BOOT_PROFILE_ZONE_PRE_INIT);
     boot_app_if_commanded();
 }
 
-static void bootloader_init(void)
+// CAN bit timing needs the HSE derived clock, everything else gets going on the HSI while it locks
+static bool clock_ready;
+
+static void update_clock(void)
 {
-    init_clock();
+    if (clock_ready) {
+        return;
+    }
 
+    clock_ready = init_clock_update();
+    if (!clock_ready) {
+        return;
+    }
+
+    // the whole bring-up, from init_clock_begin in bootloader_init
+    PROFILE_ZONE_STOP(SHARED_BOOT_PROFILE_ZONE_INIT_CLOCK);
+    PROFILE_MILESTONE(SHARED_BOOT_PROFILE_MILESTONE_CLOCK_READY);
+    // new systick reload for the faster clock, millis() carries on
+    timing_init();
+    PROFILE_BENCHMARK_CRC64_WE();
+}
+
+// CAN comes up once the clock runs and the image crc is known - the baud, node ID and boot delay may come from the app
+// parameters, which are only trusted after the check
+static void update_canbus_bringup(void)
+{
+    static bool started;
+    if (started || !clock_ready || app_verify.in_progress) {
+        return;
+    }
+    started = true;
+
+    if (!boot_timer_state.enable) {
+        check_and_start_boot_timer();
+    }
+    begin_canbus_autobaud();
+}
+
+static void bootloader_init(void)
+{
+    PROFILE_ZONE_START(SHARED_BOOT_PROFILE_ZONE_INIT_CLOCK);
+    init_clock_begin();
     timing_init();
 
 #ifdef BOARD_CONFIG_HERE_LEDS
@@ -518,21 +1515,45 @@ static void bootloader_init(void)
     here_led_init();
 #endif
 
-    update_app_info();
-    check_and_start_boot_timer();
+    // keeps off the store page if the installed image runs into it, before anything reads the store
+    const struct shared_app_descriptor_s* descriptor = shared_find_app_descriptor(_app_sec, get_app_sec_size());
+    persistent_store_init(_app_sec, descriptor ? descriptor->image_size : 0);
 
-    begin_canbus_autobaud();
+    update_app_info_at_boot();
+    check_and_start_boot_timer();
 
+    update_clock();
 }
 
 static void bootloader_update(void)
 {
+    update_clock();
+    update_app_verify(BOARD_CONFIG_APP_VERIFY_CHUNK_SIZE);
+    update_canbus_bringup();
     update_canbus_autobaud();
     update_uavcan_node_info_and_status();
     if (canbus_initialized) {
+        PROFILE_ZONE_BEGIN(SHARED_BOOT_PROFILE_ZONE_UAVCAN_UPDATE);
         uavcan_update();
+        PROFILE_ZONE_END(SHARED_BOOT_PROFILE_ZONE_UAVCAN_UPDATE);
     }
 
+#ifdef BOARD_CONFIG_PROFILING
+    static uint32_t profile_last_publish_ms;
+    if (canbus_initialized && uavcan_get_node_id() != 0 && millis()-profile_last_publish_ms >= BOARD_CONFIG_PROFILING_PUBLISH_INTERVAL_MS) {
+        profile_last_publish_ms = millis();
+        profile_publish_next();
+    }
+#endif
+
+#if BOARD_CONFIG_CAN_STATS_PUBLISH_INTERVAL_MS
+    static uint32_t can_stats_last_publish_ms;
+    if (canbus_initialized && uavcan_get_node_id() != 0 && millis()-can_stats_last_publish_ms >= BOARD_CONFIG_CAN_STATS_PUBLISH_INTERVAL_MS) {
+        can_stats_last_publish_ms = millis();
+        publish_can_stats_next();
+    }
+#endif
+
 #ifdef BOARD_CONFIG_I2C_BOOT_TRIGGER
     #warning building with i2c_boot_check
     i2c_boot_check();
@@ -550,10 +1571,24 @@ static void bootloader_update(void)
     }
 
     if (flash_state.in_progress) {
-        if (millis()-flash_state.last_req_ms > 500) {
-            do_resend_read_request();
-            if (flash_state.retries > 10) { // retry for 5 seconds
-                do_fail_update();
+        update_flash_from_file();
+    }
+
+    if (flash_state.in_progress) {
+        for (uint8_t i=0; i<BOARD_CONFIG_FILE_READ_WINDOW_SIZE; i++) {
+            struct file_read_slot_s* slot = &flash_state.slots[i];
+            if (slot->active && !slot->received && millis()-slot->last_req_ms > 500) {
+                do_resend_read_request(slot);
+                if (slot->retries > 10) { // retry for 5 seconds
+#if BOARD_CONFIG_DELTA_UPDATE
+                    if (flash_state.fetching_manifest) {
+                        begin_delta_from_manifest(NULL, 0);
+                        break;
+                    }
+#endif
+                    do_fail_update();
+                    break;
+                }
             }
         }
     } else {
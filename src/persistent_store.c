@@ -0,0 +1,229 @@
+#include <persistent_store.h>
+#include <flash.h>
+#include <helpers.h>
+#include <string.h>
+
+// NOTE: _bl_store_sec and _bl_store_sec_end symbols shall be defined in the ld script - one erasable page
+extern uint8_t _bl_store_sec[], _bl_store_sec_end;
+
+// records are appended to the erased part of the page, the payload follows the header
+struct persistent_store_record_header_s {
+    uint8_t key;
+    uint8_t len;
+    uint16_t crc16; // crc16_ccitt of key, len and payload
+};
+
+#define PERSISTENT_STORE_ERASED_KEY 0xFF
+
+#define PERSISTENT_STORE_COUNTER_TALLY_LEN ((PERSISTENT_STORE_MAX_RECORD_LEN-sizeof(uint32_t))/sizeof(uint16_t))
+
+// payload of counter keys - the crc only covers base, the tally changes in place
+struct persistent_store_counter_s {
+    uint32_t base;
+    uint16_t tally[PERSISTENT_STORE_COUNTER_TALLY_LEN]; // 0xFFFF for unused, anything else counts one
+};
+
+_Static_assert(sizeof(struct persistent_store_counter_s) == PERSISTENT_STORE_MAX_RECORD_LEN, "counter record must fill a record");
+
+static bool enabled;
+
+static bool key_is_counter(uint8_t key) {
+    return key == PERSISTENT_STORE_KEY_BOOT_COUNT;
+}
+
+static uint32_t get_store_size(void) {
+    return (uint32_t)&_bl_store_sec_end - (uint32_t)&_bl_store_sec[0];
+}
+
+static uint32_t get_record_size(uint8_t len) {
+    return sizeof(struct persistent_store_record_header_s) + ((len+1) & ~1U);
+}
+
+static uint16_t compute_record_crc16(uint8_t key, uint8_t len, const void* data) {
+    uint8_t key_len[2] = {key, len};
+    uint16_t crc = crc16_ccitt((const char*)key_len, sizeof(key_len), 0xFFFF);
+    return crc16_ccitt((const char*)data, key_is_counter(key) ? MIN(len, sizeof(uint32_t)) : len, crc);
+}
+
+// finds the latest valid record of key and the offset of the erased space after the last record
+static const struct persistent_store_record_header_s* find_record(enum persistent_store_key_t key, uint32_t* end_ofs)
+{
+    const struct persistent_store_record_header_s* ret = 0;
+    uint32_t ofs = 0;
+
+    while (ofs+sizeof(struct persistent_store_record_header_s) <= get_store_size()) {
+        const struct persistent_store_record_header_s* record = (const struct persistent_store_record_header_s*)&_bl_store_sec[ofs];
+        if (record->key == PERSISTENT_STORE_ERASED_KEY || ofs+get_record_size(record->len) > get_store_size()) {
+            break;
+        }
+
+        // records cut short by a reset fail the crc and are skipped
+        if (record->key == key && record->crc16 == compute_record_crc16(record->key, record->len, record+1)) {
+            ret = record;
+        }
+
+        ofs += get_record_size(record->len);
+    }
+
+    if (end_ofs) {
+        *end_ofs = ofs;
+    }
+
+    return ret;
+}
+
+static bool program_half_words(uint32_t ofs, const void* data, uint32_t len)
+{
+    for (uint32_t i=0; i<len; i+=sizeof(uint16_t)) {
+        uint16_t half_word = 0xFFFF;
+        memcpy(&half_word, (const uint8_t*)data+i, MIN(len-i, sizeof(uint16_t)));
+        if (!flash_program_half_word((uint16_t*)&_bl_store_sec[ofs+i], &half_word)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool append_record(uint32_t ofs, enum persistent_store_key_t key, const void* data, uint8_t len)
+{
+    struct persistent_store_record_header_s header;
+    header.key = key;
+    header.len = len;
+    header.crc16 = compute_record_crc16(key, len, data);
+
+    return program_half_words(ofs, &header, sizeof(header)) && program_half_words(ofs+sizeof(header), data, len);
+}
+
+void persistent_store_init(const uint8_t* app_image, uint32_t app_image_size)
+{
+    // a page the store wrote starts with a record key or is erased, anything else is app code or data
+    uint8_t first_key = _bl_store_sec[0];
+    enabled = app_image_size <= (uint32_t)_bl_store_sec - (uint32_t)app_image && (first_key == PERSISTENT_STORE_ERASED_KEY || first_key < PERSISTENT_STORE_NUM_KEYS);
+}
+
+bool persistent_store_enabled(void)
+{
+    return enabled;
+}
+
+bool persistent_store_reclaim(void)
+{
+    if (enabled) {
+        return true;
+    }
+
+    if (!flash_async_idle() || !flash_erase_page(_bl_store_sec)) {
+        return false;
+    }
+
+    enabled = true;
+    return true;
+}
+
+bool persistent_store_read(enum persistent_store_key_t key, void* buf, uint8_t len)
+{
+    if (!enabled) {
+        return false;
+    }
+
+    const struct persistent_store_record_header_s* record = find_record(key, 0);
+    if (!record || record->len != len) {
+        return false;
+    }
+
+    memcpy(buf, record+1, len);
+    return true;
+}
+
+bool persistent_store_write(enum persistent_store_key_t key, const void* data, uint8_t len)
+{
+    if (!enabled || key >= PERSISTENT_STORE_NUM_KEYS || len > PERSISTENT_STORE_MAX_RECORD_LEN || !flash_async_idle()) {
+        return false;
+    }
+
+    uint32_t end_ofs;
+    const struct persistent_store_record_header_s* record = find_record(key, &end_ofs);
+    if (record && record->len == len && memcmp(record+1, data, len) == 0) {
+        // already there, spare the flash
+        return true;
+    }
+
+    if (end_ofs+get_record_size(len) <= get_store_size()) {
+        return append_record(end_ofs, key, data, len);
+    }
+
+    // page full - keep the latest record of every other key across the erase
+    uint8_t saved[PERSISTENT_STORE_NUM_KEYS][PERSISTENT_STORE_MAX_RECORD_LEN];
+    uint8_t saved_len[PERSISTENT_STORE_NUM_KEYS];
+    for (uint8_t i=0; i<PERSISTENT_STORE_NUM_KEYS; i++) {
+        record = find_record((enum persistent_store_key_t)i, 0);
+        saved_len[i] = 0;
+        if (i != key && record && record->len <= PERSISTENT_STORE_MAX_RECORD_LEN) {
+            saved_len[i] = record->len;
+            memcpy(saved[i], record+1, record->len);
+        }
+    }
+
+    if (!flash_erase_page(_bl_store_sec)) {
+        return false;
+    }
+
+    uint32_t ofs = 0;
+    for (uint8_t i=0; i<PERSISTENT_STORE_NUM_KEYS; i++) {
+        if (saved_len[i] > 0) {
+            if (!append_record(ofs, (enum persistent_store_key_t)i, saved[i], saved_len[i])) {
+                return false;
+            }
+            ofs += get_record_size(saved_len[i]);
+        }
+    }
+
+    return append_record(ofs, key, data, len);
+}
+
+uint32_t persistent_store_counter_read(enum persistent_store_key_t key)
+{
+    if (!enabled) {
+        return 0;
+    }
+
+    const struct persistent_store_record_header_s* record = find_record(key, 0);
+    if (!record || record->len != sizeof(struct persistent_store_counter_s)) {
+        return 0;
+    }
+
+    // records are only half-word aligned
+    const struct persistent_store_counter_s* counter = (const struct persistent_store_counter_s*)(record+1);
+    uint32_t ret;
+    memcpy(&ret, &counter->base, sizeof(ret));
+    for (uint8_t i=0; i<PERSISTENT_STORE_COUNTER_TALLY_LEN; i++) {
+        if (counter->tally[i] != 0xFFFF) {
+            ret++;
+        }
+    }
+    return ret;
+}
+
+bool persistent_store_counter_increment(enum persistent_store_key_t key)
+{
+    if (!enabled || !key_is_counter(key) || !flash_async_idle()) {
+        return false;
+    }
+
+    const struct persistent_store_record_header_s* record = find_record(key, 0);
+    if (record && record->len == sizeof(struct persistent_store_counter_s)) {
+        const struct persistent_store_counter_s* counter = (const struct persistent_store_counter_s*)(record+1);
+        for (uint8_t i=0; i<PERSISTENT_STORE_COUNTER_TALLY_LEN; i++) {
+            if (counter->tally[i] == 0xFFFF) {
+                const uint16_t zero = 0;
+                return flash_program_half_word((uint16_t*)&counter->tally[i], &zero);
+            }
+        }
+    }
+
+    // no record yet or the tally is used up - start a new one
+    struct persistent_store_counter_s counter;
+    memset(&counter, 0xFF, sizeof(counter));
+    counter.base = persistent_store_counter_read(key)+1;
+    return persistent_store_write(key, &counter, sizeof(counter));
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Small records kept in a flash page reserved for the bootloader, the last valid record of a key wins.
+// Writes use the blocking flash functions and fail while asynchronous flash jobs are pending.
+
+#define PERSISTENT_STORE_MAX_RECORD_LEN 32
+
+enum persistent_store_key_t {
+    PERSISTENT_STORE_KEY_FLASH_GENERATION = 0,
+    PERSISTENT_STORE_KEY_VALIDATED_IMAGE = 1,
+    PERSISTENT_STORE_KEY_CANBUS_BAUDRATE = 2,
+    PERSISTENT_STORE_KEY_PREFERRED_NODE_ID = 3,
+    PERSISTENT_STORE_KEY_BOOT_COUNT = 4, // counter
+    PERSISTENT_STORE_NUM_KEYS
+};
+
+// Call before any other function. An app image installed under an older layout may still run into the store page -
+// until persistent_store_reclaim the page is then left alone, reads fail and writes are refused.
+void persistent_store_init(const uint8_t* app_image, uint32_t app_image_size);
+bool persistent_store_enabled(void);
+// erases the page and enables the store, for when the app that ran into it is about to be overwritten
+bool persistent_store_reclaim(void);
+
+bool persistent_store_read(enum persistent_store_key_t key, void* buf, uint8_t len);
+bool persistent_store_write(enum persistent_store_key_t key, const void* data, uint8_t len);
+
+// Counter keys hold a base value and a tally of half-words. An increment programs the next tally half-word to 0x0000 in
+// place, which the flash allows over an already programmed word, so only every PERSISTENT_STORE_COUNTER_TALLY_LEN-th
+// increment appends a record.
+uint32_t persistent_store_counter_read(enum persistent_store_key_t key);
+bool persistent_store_counter_increment(enum persistent_store_key_t key);
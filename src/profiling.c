@@ -0,0 +1,104 @@
+#include <profiling.h>
+
+#ifdef BOARD_CONFIG_PROFILING
+#include <uavcan.h>
+#include <crc64_we.h>
+#include <string.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/memorymap.h>
+
+#define PROFILE_CRC64_WE_BENCHMARK_LEN 1024
+
+static struct shared_boot_profile_s profile;
+static uint8_t publish_idx;
+static uint32_t zone_start_cycles[SHARED_BOOT_PROFILE_NUM_ZONES];
+static uint32_t crc64_we_benchmark_cycles;
+static volatile uint64_t crc64_we_benchmark_result;
+
+static const char* const zone_names[SHARED_BOOT_PROFILE_NUM_ZONES] = {
+    "pre_init", "clock", "verify", "uavcan", "flash_job", "flash_sync"
+};
+
+static const char* const milestone_names[SHARED_BOOT_PROFILE_NUM_MILESTONES] = {
+    "clock_ready", "verified", "baud", "node_id", "boot", "jump"
+};
+
+void profile_init(void)
+{
+    dwt_enable_cycle_counter();
+    // keeps running across a system reset
+    DWT_CYCCNT = 0;
+}
+
+void profile_zone_record(enum shared_boot_profile_zone_t zone, uint32_t cycles)
+{
+    struct shared_boot_profile_zone_s* z = &profile.zones[zone];
+    if (z->max_cycles == 0 || cycles < z->min_cycles) {
+        z->min_cycles = cycles;
+    }
+    if (cycles > z->max_cycles) {
+        z->max_cycles = cycles;
+    }
+    z->last_cycles = cycles;
+}
+
+void profile_zone_start(enum shared_boot_profile_zone_t zone)
+{
+    zone_start_cycles[zone] = DWT_CYCCNT;
+}
+
+void profile_zone_stop(enum shared_boot_profile_zone_t zone)
+{
+    profile_zone_record(zone, DWT_CYCCNT-zone_start_cycles[zone]);
+}
+
+void profile_milestone(enum shared_boot_profile_milestone_t milestone)
+{
+    if (profile.milestone_cycles[milestone] == 0) {
+        profile.milestone_cycles[milestone] = DWT_CYCCNT;
+    }
+}
+
+// crc64_we over 1K of flash, the same wait states and table setting the image check runs with
+void profile_benchmark_crc64_we(void)
+{
+    uint32_t begin = DWT_CYCCNT;
+    crc64_we_benchmark_result = crc64_we((const uint8_t*)FLASH_BASE, PROFILE_CRC64_WE_BENCHMARK_LEN, 0);
+    crc64_we_benchmark_cycles = DWT_CYCCNT-begin;
+}
+
+struct shared_boot_profile_s* profile_get(void)
+{
+    profile.core_clock_hz = rcc_ahb_frequency;
+    return &profile;
+}
+
+// one KeyValue per call, so the tx queue is not flooded
+void profile_publish_next(void)
+{
+    char key[24];
+    float val;
+
+    if (publish_idx < SHARED_BOOT_PROFILE_NUM_ZONES*3) {
+        const struct shared_boot_profile_zone_s* z = &profile.zones[publish_idx/3];
+        static const char* const stat_names[3] = {".min", ".max", ".last"};
+        const uint32_t stats[3] = {z->min_cycles, z->max_cycles, z->last_cycles};
+
+        strcpy(key, "p.");
+        strcat(key, zone_names[publish_idx/3]);
+        strcat(key, stat_names[publish_idx%3]);
+        val = stats[publish_idx%3];
+    } else if (publish_idx == SHARED_BOOT_PROFILE_NUM_ZONES*3+SHARED_BOOT_PROFILE_NUM_MILESTONES) {
+        strcpy(key, "p.crc64_kb");
+        val = crc64_we_benchmark_cycles;
+    } else {
+        uint8_t milestone = publish_idx-SHARED_BOOT_PROFILE_NUM_ZONES*3;
+        strcpy(key, "p.t.");
+        strcat(key, milestone_names[milestone]);
+        val = profile.milestone_cycles[milestone];
+    }
+
+    uavcan_send_debug_key_value(key, val);
+    publish_idx = (publish_idx+1) % (SHARED_BOOT_PROFILE_NUM_ZONES*3+SHARED_BOOT_PROFILE_NUM_MILESTONES+1);
+}
+#endif
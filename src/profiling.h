@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <shared_boot_msg.h>
+
+// Boot profiling on the DWT cycle counter, built in with BOARD_CONFIG_PROFILING.
+// Such builds hand the app SHARED_MSG_BOOT_INFO_PROFILED instead of SHARED_MSG_BOOT_INFO, so only use them with apps
+// that accept it - any other app starts without the confirmed baud rate and node ID.
+// A zone is timed between PROFILE_ZONE_BEGIN and PROFILE_ZONE_END in the same scope, or between PROFILE_ZONE_START and
+// PROFILE_ZONE_STOP anywhere.
+#ifdef BOARD_CONFIG_PROFILING
+#include <libopencm3/cm3/dwt.h>
+
+#define PROFILE_ZONE_BEGIN(zone) uint32_t profile_begin_##zone = DWT_CYCCNT
+#define PROFILE_ZONE_END(zone) profile_zone_record(zone, DWT_CYCCNT-profile_begin_##zone)
+#define PROFILE_ZONE_START(zone) profile_zone_start(zone)
+#define PROFILE_ZONE_STOP(zone) profile_zone_stop(zone)
+#define PROFILE_MILESTONE(milestone) profile_milestone(milestone)
+#define PROFILE_BENCHMARK_CRC64_WE() profile_benchmark_crc64_we()
+
+void profile_init(void);
+void profile_zone_record(enum shared_boot_profile_zone_t zone, uint32_t cycles);
+void profile_zone_start(enum shared_boot_profile_zone_t zone);
+void profile_zone_stop(enum shared_boot_profile_zone_t zone);
+void profile_milestone(enum shared_boot_profile_milestone_t milestone);
+void profile_benchmark_crc64_we(void);
+struct shared_boot_profile_s* profile_get(void);
+void profile_publish_next(void);
+#else
+#define PROFILE_ZONE_BEGIN(zone) do {} while (0)
+#define PROFILE_ZONE_END(zone) do {} while (0)
+#define PROFILE_ZONE_START(zone) do {} while (0)
+#define PROFILE_ZONE_STOP(zone) do {} while (0)
+#define PROFILE_MILESTONE(milestone) do {} while (0)
+#define PROFILE_BENCHMARK_CRC64_WE() do {} while (0)
+#endif
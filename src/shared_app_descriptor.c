@@ -2,41 +2,63 @@
 #include <crc64_we.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 
-static const void* shared_find_marker(void* marker, uint32_t marker_len, uint8_t* buf, uint32_t buf_len)
+const struct shared_app_descriptor_s* shared_find_app_descriptor(uint8_t* buf, uint32_t buf_len)
 {
-    if (buf_len < marker_len) {
-        return 0;
+    uint64_t signature;
+    memcpy(&signature, SHARED_APP_DESCRIPTOR_SIGNATURE, sizeof(signature));
+
+    // images packed by tools/crc_binary.py say where the descriptor is
+    if (buf_len >= SHARED_APP_DESCRIPTOR_OFS_LOCATION+sizeof(uint32_t)) {
+        uint32_t ofs;
+        memcpy(&ofs, &buf[SHARED_APP_DESCRIPTOR_OFS_LOCATION], sizeof(ofs));
+        if (ofs % sizeof(uint64_t) == 0 && ofs <= buf_len && buf_len-ofs >= sizeof(struct shared_app_descriptor_s) && *(const uint64_t*)&buf[ofs] == signature) {
+            return (const struct shared_app_descriptor_s*)&buf[ofs];
+        }
     }
 
-    for (uint32_t i=0; i<buf_len-marker_len; i++) {
-        if (!memcmp(&buf[i], marker, marker_len)) {
-            return &buf[i];
+    // otherwise scan - the descriptor is aligned(8), buf must be too
+    for (uint32_t i=0; i+sizeof(uint64_t) <= buf_len; i+=sizeof(uint64_t)) {
+        if (*(const uint64_t*)&buf[i] == signature) {
+            return (const struct shared_app_descriptor_s*)&buf[i];
         }
     }
+
     return 0;
 }
 
-const struct shared_app_descriptor_s* shared_find_app_descriptor(uint8_t* buf, uint32_t buf_len)
+// offset of the crc64 field, which moved when FMT 2 added image_verify_interval
+static uint32_t param_struct_crc64_ofs(uint8_t parameters_fmt)
 {
-    return shared_find_marker(((uint64_t*)SHARED_APP_DESCRIPTOR_SIGNATURE), sizeof(uint64_t), buf, buf_len);
+    if (parameters_fmt == 1) {
+        return offsetof(struct shared_app_parameters_s, image_verify_interval);
+    }
+    return offsetof(struct shared_app_parameters_s, crc64);
 }
 
-static bool param_struct_valid(const struct shared_app_parameters_s* parameters, bool ignore_crc64)
+static bool param_struct_valid(const struct shared_app_parameters_s* parameters, uint8_t parameters_fmt, bool ignore_crc64)
 {
-    return parameters && (ignore_crc64 || crc64_we((uint8_t*)parameters, sizeof(struct shared_app_parameters_s)-sizeof(uint64_t), 0) == parameters->crc64);
+    if (!parameters) {
+        return false;
+    }
+
+    uint32_t crc64_ofs = param_struct_crc64_ofs(parameters_fmt);
+    uint64_t crc64;
+    memcpy(&crc64, (const uint8_t*)parameters+crc64_ofs, sizeof(crc64));
+    return ignore_crc64 || crc64_we((const uint8_t*)parameters, crc64_ofs, 0) == crc64;
 }
 
 const struct shared_app_parameters_s* shared_get_parameters(const struct shared_app_descriptor_s* descriptor)
 {
-    if (descriptor->parameters_fmt != SHARED_APP_PARAMETERS_FMT) {
+    if (descriptor->parameters_fmt != 1 && descriptor->parameters_fmt != SHARED_APP_PARAMETERS_FMT) {
         return 0;
     }
 
     const struct shared_app_parameters_s* ret = 0;
 
     for (uint8_t i=0; i<2; i++) {
-        if (param_struct_valid(descriptor->parameters[i], descriptor->parameters_ignore_crc64) &&
+        if (param_struct_valid(descriptor->parameters[i], descriptor->parameters_fmt, descriptor->parameters_ignore_crc64) &&
             (!ret || (int8_t)(descriptor->parameters[i]->param_idx-ret->param_idx) > 0)) {
             ret = descriptor->parameters[i];
             }
@@ -44,3 +66,11 @@ const struct shared_app_parameters_s* shared_get_parameters(const struct shared_
 
     return ret;
 }
+
+uint8_t shared_get_image_verify_interval(const struct shared_app_descriptor_s* descriptor, const struct shared_app_parameters_s* parameters, uint8_t default_interval)
+{
+    if (!parameters || descriptor->parameters_fmt < 2) {
+        return default_interval;
+    }
+    return parameters->image_verify_interval;
+}
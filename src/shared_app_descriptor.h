@@ -12,7 +12,10 @@
 
 #define SHARED_APP_DESCRIPTOR_SIGNATURE "\x40\xa2\xe4\xf1\x64\x68\x91\x06"
 
-#define SHARED_APP_PARAMETERS_FMT 1
+// offset of the reserved vector table entry that holds the descriptor offset, written by tools/crc_binary.py
+#define SHARED_APP_DESCRIPTOR_OFS_LOCATION 0x1C
+
+#define SHARED_APP_PARAMETERS_FMT 2
 
 struct shared_app_parameters_s {
     // this index is incremented on every param write - if two param structure pointers are provided,
@@ -22,13 +25,16 @@ struct shared_app_parameters_s {
     uint32_t canbus_disable_auto_baud : 1;
     uint32_t canbus_baudrate : 31;
     uint8_t canbus_local_node_id;
+    // FMT 2 and later - in FMT 1 crc64 follows canbus_local_node_id
+    // boots between full image crc checks while the bootloader trusts its validation record, 0 to check every boot
+    uint8_t image_verify_interval;
     uint64_t crc64;
 } APP_DESCRIPTOR_PACKED;
 
 struct shared_app_descriptor_s {
     char signature[8];
     uint64_t image_crc;
-    uint32_t image_size;
+    uint32_t image_size; // the bootloader refuses images past its app region, 48K on the 64K boards
     uint32_t vcs_commit;
     uint8_t major_version;
     uint8_t minor_version;
@@ -39,3 +45,4 @@ struct shared_app_descriptor_s {
 
 const struct shared_app_descriptor_s* shared_find_app_descriptor(uint8_t* buf, uint32_t buf_len);
 const struct shared_app_parameters_s* shared_get_parameters(const struct shared_app_descriptor_s* descriptor);
+uint8_t shared_get_image_verify_interval(const struct shared_app_descriptor_s* descriptor, const struct shared_app_parameters_s* parameters, uint8_t default_interval);
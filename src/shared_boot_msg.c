@@ -28,6 +28,12 @@ static int16_t get_payload_length(enum shared_msg_t msgid) {
             return sizeof(struct shared_boot_info_msg_s);
         case SHARED_MSG_CANBUS_INFO:
             return sizeof(struct shared_canbus_info_s);
+        case SHARED_MSG_UPDATE_PROGRESS:
+            return sizeof(struct shared_update_progress_msg_s);
+        case SHARED_MSG_BOOT_PROFILED:
+            return sizeof(struct shared_boot_profiled_msg_s);
+        case SHARED_MSG_BOOT_INFO_PROFILED:
+            return sizeof(struct shared_boot_info_profiled_msg_s);
     };
 
     return -1;
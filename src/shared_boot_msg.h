@@ -11,7 +11,12 @@ enum shared_msg_t {
     SHARED_MSG_BOOT = 0,
     SHARED_MSG_FIRMWAREUPDATE = 1,
     SHARED_MSG_BOOT_INFO = 2,
-    SHARED_MSG_CANBUS_INFO = 3
+    SHARED_MSG_CANBUS_INFO = 3,
+    SHARED_MSG_UPDATE_PROGRESS = 4,
+    SHARED_MSG_BOOT_PROFILED = 5,
+    // Sent instead of SHARED_MSG_BOOT_INFO by bootloaders built with BOARD_CONFIG_PROFILING. An app that only knows
+    // BOOT_INFO does not find its message and loses the confirmed baud rate and node ID, redoing autobaud and allocation.
+    SHARED_MSG_BOOT_INFO_PROFILED = 6
 };
 
 struct shared_canbus_info_s {
@@ -55,11 +60,72 @@ struct shared_boot_info_msg_s {
     uint8_t boot_reason; // >= 127 are vendor/application-specific codes
 } SHARED_MSG_PACKED;
 
+// written by the bootloader after every fully programmed page so an interrupted update can be resumed
+struct shared_update_progress_msg_s {
+    struct shared_canbus_info_s canbus_info;
+    uint8_t source_node_id;
+    uint64_t path_hash; // FNV-1a of the firmware path
+    uint32_t committed_ofs; // all bytes below this offset are in flash, except for app_header
+    uint64_t crc64; // crc64_we of the image bytes below committed_ofs, with the descriptor image_crc field taken as zero
+    uint32_t image_crc_ofs; // offset of the descriptor image_crc field, 0 if it is not below committed_ofs
+    uint8_t app_header[8]; // first 8 bytes of the image, only programmed once the update completes
+} SHARED_MSG_PACKED;
+
+enum shared_boot_profile_zone_t {
+    SHARED_BOOT_PROFILE_ZONE_PRE_INIT = 0,
+    SHARED_BOOT_PROFILE_ZONE_INIT_CLOCK = 1,
+    SHARED_BOOT_PROFILE_ZONE_APP_VERIFY = 2,
+    SHARED_BOOT_PROFILE_ZONE_UAVCAN_UPDATE = 3,
+    SHARED_BOOT_PROFILE_ZONE_FLASH_JOB = 4,
+    SHARED_BOOT_PROFILE_ZONE_FLASH_SYNC = 5,
+    SHARED_BOOT_PROFILE_NUM_ZONES
+};
+
+enum shared_boot_profile_milestone_t {
+    SHARED_BOOT_PROFILE_MILESTONE_CLOCK_READY = 0,
+    SHARED_BOOT_PROFILE_MILESTONE_APP_VERIFIED = 1,
+    SHARED_BOOT_PROFILE_MILESTONE_BAUD_CONFIRMED = 2,
+    SHARED_BOOT_PROFILE_MILESTONE_NODE_ID_ASSIGNED = 3,
+    SHARED_BOOT_PROFILE_MILESTONE_BOOT_COMMANDED = 4,
+    // counted from power up when the bootloader jumps straight to the app (BOARD_CONFIG_BOOT_DIRECT_JUMP), from the
+    // reset that follows BOOT_COMMANDED otherwise
+    SHARED_BOOT_PROFILE_MILESTONE_APP_JUMP = 5,
+    SHARED_BOOT_PROFILE_NUM_MILESTONES
+};
+
+struct shared_boot_profile_zone_s {
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint32_t last_cycles;
+} SHARED_MSG_PACKED;
+
+// DWT cycle counts, only filled in by bootloaders built with BOARD_CONFIG_PROFILING
+struct shared_boot_profile_s {
+    uint32_t core_clock_hz;
+    uint32_t milestone_cycles[SHARED_BOOT_PROFILE_NUM_MILESTONES]; // cycles since reset, 0 if not reached
+    struct shared_boot_profile_zone_s zones[SHARED_BOOT_PROFILE_NUM_ZONES];
+} SHARED_MSG_PACKED;
+
+// SHARED_MSG_BOOT carrying the boot profile across the reset into the app
+struct shared_boot_profiled_msg_s {
+    struct shared_boot_msg_s boot_msg;
+    struct shared_boot_profile_s profile;
+} SHARED_MSG_PACKED;
+
+// superset of SHARED_MSG_BOOT_INFO, sent to the app instead of it by profiling bootloaders - apps need to accept both
+struct shared_boot_info_profiled_msg_s {
+    struct shared_boot_info_msg_s boot_info_msg;
+    struct shared_boot_profile_s profile;
+} SHARED_MSG_PACKED;
+
 union shared_msg_payload_u {
     struct shared_boot_msg_s boot_msg;
     struct shared_firmwareupdate_msg_s firmwareupdate_msg;
     struct shared_boot_info_msg_s boot_info_msg;
     struct shared_canbus_info_s canbus_info;
+    struct shared_update_progress_msg_s update_progress_msg;
+    struct shared_boot_profiled_msg_s boot_profiled_msg;
+    struct shared_boot_info_profiled_msg_s boot_info_profiled_msg;
 };
 
 bool shared_msg_check_and_retreive(enum shared_msg_t* msgid, union shared_msg_payload_u* msg_payload);
@@ -33,6 +33,14 @@ void timing_init(void)
     systick_interrupt_enable();
 }
 
+void timing_deinit(void)
+{
+    systick_interrupt_disable();
+    systick_counter_disable();
+    systick_set_reload(0);
+    systick_clear();
+}
+
 uint32_t millis(void) {
     return system_millis;
 }
@@ -18,6 +18,7 @@
 #include <stdint.h>
 
 void timing_init(void);
+void timing_deinit(void);
 uint32_t millis(void);
 uint32_t micros(void);
 void usleep(uint32_t delay);
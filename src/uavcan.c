@@ -1,4 +1,5 @@
 #include <uavcan.h>
+#include <uavcan_codecs.h>
 #include <can.h>
 #include <timing.h>
 #include <stdlib.h>
@@ -16,8 +17,9 @@
 #define UAVCAN_NODE_ID_ALLOCATION_MAX_REQUEST_PERIOD_US             1000000U
 #define UAVCAN_NODE_ID_ALLOCATION_MIN_FOLLOWUP_PERIOD_US            0U
 #define UAVCAN_NODE_ID_ALLOCATION_MAX_FOLLOWUP_PERIOD_US            400000U
-#define UAVCAN_NODE_ID_ALLOCATION_UID_BIT_OFFSET                    8
 #define UAVCAN_NODE_ID_ALLOCATION_MAX_LENGTH_OF_UID_IN_REQUEST      6
+// an allocator answering within this long of our request is answering us, so follow up without the random delay
+#define UAVCAN_NODE_ID_ALLOCATION_FAST_RESPONSE_US                  50000U
 
 #define UAVCAN_NODE_STATUS_MESSAGE_SIZE                             7
 #define UAVCAN_NODE_STATUS_DATA_TYPE_ID                             341
@@ -27,6 +29,9 @@
 #define UAVCAN_GET_NODE_INFO_DATA_TYPE_SIGNATURE                    0xee468a8121c46a9e
 #define UAVCAN_GET_NODE_INFO_DATA_TYPE_ID                           1
 
+#define UAVCAN_GET_TRANSPORT_STATS_DATA_TYPE_ID                     4
+#define UAVCAN_GET_TRANSPORT_STATS_DATA_TYPE_SIGNATURE              0xbe6f76a7ec312b04
+
 #define UAVCAN_RESTARTNODE_REQUEST_MAX_SIZE                         BIT_LEN_TO_SIZE(40)
 #define UAVCAN_RESTARTNODE_RESPONSE_MAX_SIZE                        BIT_LEN_TO_SIZE(1)
 #define UAVCAN_RESTARTNODE_DATA_TYPE_ID                             5
@@ -60,24 +65,48 @@
 
 #define UNIQUE_ID_LENGTH_BYTES                                      16
 
+// 29-bit CAN ID layout, priority bits are never matched
+#define UAVCAN_CAN_ID_MESSAGE(type_id)                              ((uint32_t)(type_id) << 8)
+#define UAVCAN_CAN_ID_MESSAGE_MASK                                  0x00FFFF80U
+#define UAVCAN_CAN_ID_ANON_MESSAGE(type_id)                         (((uint32_t)(type_id) & 0x3U) << 8)
+#define UAVCAN_CAN_ID_ANON_MESSAGE_MASK                             0x000003FFU
+#define UAVCAN_CAN_ID_SERVICE(type_id, request, dest_node_id)       (((uint32_t)(type_id) << 16) | ((uint32_t)(request) << 15) | ((uint32_t)(dest_node_id) << 8) | (1U << 7))
+#define UAVCAN_CAN_ID_SERVICE_MASK                                  0x00FFFF80U
+
 static struct uavcan_node_info_s node_info;
 
+// GetNodeInfo response serialized on the first request after node info changes, requests only patch the NodeStatus
+static uint8_t node_info_response[UAVCAN_GET_NODE_INFO_RESPONSE_MAX_SIZE];
+static uint16_t node_info_response_len;
+static bool node_info_response_dirty = true;
+
 static restart_handler_ptr restart_cb;
 static file_beginfirmwareupdate_handler_ptr file_beginfirmwareupdate_cb;
 static file_read_response_handler_ptr file_read_response_cb;
 static uavcan_ready_handler_ptr uavcan_ready_cb;
 
 static CanardInstance canard;
-static uint8_t canard_memory_pool[1024] __attribute__((aligned));
+static uint8_t canard_memory_pool[2048] __attribute__((aligned));
 static bool canard_initialized;
 
 static uint8_t node_health = UAVCAN_HEALTH_OK;
 static uint8_t node_mode   = UAVCAN_MODE_INITIALIZATION;
+static uint16_t node_vendor_status;
+
+// transfer level counters for GetTransportStats, frame level ones come from canbus_get_stats
+static uint32_t transfers_tx;
+static uint32_t transfers_rx;
+static uint32_t transfer_errors;
 
 static struct {
     uint32_t request_timer_begin_us;
     uint32_t request_delay_us;
     uint32_t unique_id_offset;
+    uint32_t started_us;
+    uint32_t last_request_us;
+    uint32_t time_to_id_us;
+    uint8_t preferred_node_id;
+    bool request_sent;
 } allocation_state;
 
 static uint8_t node_unique_id[UNIQUE_ID_LENGTH_BYTES];
@@ -92,6 +121,55 @@ static bool shouldAcceptTransfer(const CanardInstance* ins, uint64_t* out_data_t
 static void process1HzTasks(void);
 static void onTransferReceived(CanardInstance* ins, CanardRxTransfer* transfer);
 static struct uavcan_transfer_info_s get_transfer_info(const CanardInstance* ins, CanardRxTransfer* transfer);
+static void set_local_node_id(uint8_t node_id);
+static void count_transfer_tx(int result);
+static uint16_t copy_transfer_payload(CanardRxTransfer* transfer, uint8_t* buf, uint16_t len);
+static void update_hw_filters(void);
+
+static void handle_allocation_data_broadcast(CanardInstance* ins, CanardRxTransfer* transfer);
+static void handle_get_node_info_request(CanardInstance* ins, CanardRxTransfer* transfer);
+static void handle_get_transport_stats_request(CanardInstance* ins, CanardRxTransfer* transfer);
+static void handle_restart_node_request(CanardInstance* ins, CanardRxTransfer* transfer);
+static void handle_file_beginfirmwareupdate_request(CanardInstance* ins, CanardRxTransfer* transfer);
+static void handle_file_read_response(CanardInstance* ins, CanardRxTransfer* transfer);
+
+// Every transfer the node takes, in any order. during_allocation entries are only accepted while the node is
+// anonymous, all others only once it has a node ID. Boards append entries of the same form
+// { transfer_type, data_type_id, data_type_signature, handler, during_allocation }, with the handlers built from
+// sources in the board directory, through BOARD_CONFIG_UAVCAN_TRANSFER_HANDLERS. board.h is included ahead of
+// canard.h, so it declares the handlers in BOARD_CONFIG_UAVCAN_TRANSFER_HANDLER_DECLS instead of directly - the board
+// sources expand it after including canard.h as well, which keeps -Wmissing-prototypes quiet.
+#ifdef BOARD_CONFIG_UAVCAN_TRANSFER_HANDLER_DECLS
+BOARD_CONFIG_UAVCAN_TRANSFER_HANDLER_DECLS
+#endif
+
+struct transfer_handler_s {
+    CanardTransferType transfer_type;
+    uint16_t data_type_id;
+    uint64_t data_type_signature;
+    void (*handler)(CanardInstance* ins, CanardRxTransfer* transfer);
+    bool during_allocation;
+};
+
+static const struct transfer_handler_s transfer_handlers[] = {
+    { CanardTransferTypeBroadcast, UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_ID, UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_SIGNATURE, handle_allocation_data_broadcast, true },
+    { CanardTransferTypeRequest, UAVCAN_GET_NODE_INFO_DATA_TYPE_ID, UAVCAN_GET_NODE_INFO_DATA_TYPE_SIGNATURE, handle_get_node_info_request, false },
+    { CanardTransferTypeRequest, UAVCAN_GET_TRANSPORT_STATS_DATA_TYPE_ID, UAVCAN_GET_TRANSPORT_STATS_DATA_TYPE_SIGNATURE, handle_get_transport_stats_request, false },
+    { CanardTransferTypeRequest, UAVCAN_RESTARTNODE_DATA_TYPE_ID, UAVCAN_RESTARTNODE_DATA_TYPE_SIGNATURE, handle_restart_node_request, false },
+    { CanardTransferTypeRequest, UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_ID, UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_SIGNATURE, handle_file_beginfirmwareupdate_request, false },
+    { CanardTransferTypeResponse, UAVCAN_FILE_READ_DATA_TYPE_ID, UAVCAN_FILE_READ_DATA_TYPE_SIGNATURE, handle_file_read_response, false },
+#ifdef BOARD_CONFIG_UAVCAN_TRANSFER_HANDLERS
+    BOARD_CONFIG_UAVCAN_TRANSFER_HANDLERS
+#endif
+};
+
+#define NUM_TRANSFER_HANDLERS (sizeof(transfer_handlers)/sizeof(transfer_handlers[0]))
+
+// indices into transfer_handlers sorted by transfer_handler_key, built by uavcan_init
+static uint8_t sorted_transfer_handlers[NUM_TRANSFER_HANDLERS];
+
+static void sort_transfer_handlers(void);
+static const struct transfer_handler_s* find_transfer_handler(CanardTransferType transfer_type, uint16_t data_type_id);
 
 static void allocation_init(void);
 static void allocation_update(void);
@@ -103,7 +181,9 @@ static void allocation_start_followup_timer(void);
 void uavcan_init(void)
 {
     desig_get_unique_id((uint32_t*)&node_unique_id[0]);
+    sort_transfer_handlers();
     canardInit(&canard, canard_memory_pool, sizeof(canard_memory_pool), onTransferReceived, shouldAcceptTransfer, NULL);
+    update_hw_filters();
     allocation_init();
     canard_initialized = true;
 }
@@ -127,17 +207,16 @@ void uavcan_update(void)
         called_uavcan_ready_cb = true;
     }
 
-    // receive
+    // receive - drain everything the RX interrupts have buffered
     CanardCANFrame rx_frame;
     struct canbus_msg msg;
-    const uint64_t timestamp = micros();
-    if (canbus_recv_message(&msg)) {
+    while (canbus_recv_message(&msg)) {
         rx_frame.id = msg.id & CANARD_CAN_EXT_ID_MASK;
         if (msg.ide) rx_frame.id |= CANARD_CAN_FRAME_EFF;
         if (msg.rtr) rx_frame.id |= CANARD_CAN_FRAME_RTR;
         rx_frame.data_len = msg.dlc;
         memcpy(rx_frame.data, msg.data, 8);
-        canardHandleRxFrame(&canard, &rx_frame, timestamp);
+        canardHandleRxFrame(&canard, &rx_frame, msg.timestamp_us);
     }
 
     // transmit
@@ -170,7 +249,86 @@ static struct uavcan_transfer_info_s get_transfer_info(const CanardInstance* ins
 }
 
 void uavcan_set_node_id(uint8_t node_id) {
+    set_local_node_id(node_id);
+}
+
+// asked for in allocation requests, e.g. the node ID this node was allocated last time
+void uavcan_set_preferred_node_id(uint8_t node_id) {
+    if (node_id > 127) {
+        return;
+    }
+    allocation_state.preferred_node_id = node_id;
+
+    // the first request can go out sooner now
+    if (!allocation_state.request_sent) {
+        allocation_start_request_timer();
+    }
+}
+
+// how long dynamic allocation took to get a node ID, 0 if it did not run or has not finished
+uint32_t uavcan_get_node_id_allocation_time_us(void) {
+    return allocation_state.time_to_id_us;
+}
+
+static void set_local_node_id(uint8_t node_id) {
     canardSetLocalNodeID(&canard, node_id);
+    update_hw_filters();
+}
+
+// program the CAN acceptance filters with exactly the set of transfers shouldAcceptTransfer takes - if that needs more
+// banks than there are, accept everything and leave it to shouldAcceptTransfer
+static void update_hw_filters(void)
+{
+    struct canbus_filter_s filters[NUM_TRANSFER_HANDLERS*2];
+    uint8_t num_filters = 0;
+
+    const bool allocating = allocation_running();
+    const uint8_t node_id = canardGetLocalNodeID(&canard);
+
+    for (uint8_t i=0; i<NUM_TRANSFER_HANDLERS; i++) {
+        const struct transfer_handler_s* h = &transfer_handlers[i];
+        if (h->during_allocation != allocating) {
+            continue;
+        }
+
+        switch (h->transfer_type) {
+            case CanardTransferTypeBroadcast:
+                filters[num_filters].id = UAVCAN_CAN_ID_MESSAGE(h->data_type_id);
+                filters[num_filters].mask = UAVCAN_CAN_ID_MESSAGE_MASK;
+                filters[num_filters].fifo = 0;
+                num_filters++;
+
+                if (allocating) {
+                    // requests from other anonymous nodes, which restart our request timer
+                    filters[num_filters].id = UAVCAN_CAN_ID_ANON_MESSAGE(h->data_type_id);
+                    filters[num_filters].mask = UAVCAN_CAN_ID_ANON_MESSAGE_MASK;
+                    filters[num_filters].fifo = 0;
+                    num_filters++;
+                }
+                break;
+
+            case CanardTransferTypeRequest:
+                filters[num_filters].id = UAVCAN_CAN_ID_SERVICE(h->data_type_id, 1, node_id);
+                filters[num_filters].mask = UAVCAN_CAN_ID_SERVICE_MASK;
+                filters[num_filters].fifo = 0;
+                num_filters++;
+                break;
+
+            case CanardTransferTypeResponse:
+                // responses (file data) get their own FIFO so they never compete with requests for FIFO space
+                filters[num_filters].id = UAVCAN_CAN_ID_SERVICE(h->data_type_id, 0, node_id);
+                filters[num_filters].mask = UAVCAN_CAN_ID_SERVICE_MASK;
+                filters[num_filters].fifo = 1;
+                num_filters++;
+                break;
+        }
+    }
+
+    if (num_filters > CANBUS_NUM_FILTER_BANKS) {
+        num_filters = 0;
+    }
+
+    canbus_set_filters(filters, num_filters);
 }
 
 uint8_t uavcan_get_node_id() {
@@ -187,6 +345,11 @@ void uavcan_set_node_health(enum uavcan_node_health_t health)
     node_health = health;
 }
 
+void uavcan_set_node_vendor_status(uint16_t vendor_status)
+{
+    node_vendor_status = vendor_status;
+}
+
 void uavcan_set_uavcan_ready_cb(uavcan_ready_handler_ptr cb)
 {
     uavcan_ready_cb = cb;
@@ -208,42 +371,25 @@ void uavcan_set_file_read_response_cb(file_read_response_handler_ptr cb)
     file_read_response_cb = cb;
 }
 
-void uavcan_set_node_info(struct uavcan_node_info_s new_node_info)
+void uavcan_set_node_info(const struct uavcan_node_info_s* new_node_info)
 {
-    node_info = new_node_info;
+    node_info = *new_node_info;
+    node_info_response_dirty = true;
 }
 
 void uavcan_send_debug_key_value(const char* name, float val)
 {
-    size_t name_len = strlen(name);
     uint8_t msg_buf[UAVCAN_DEBUG_KEYVALUE_MESSAGE_MAX_SIZE];
-    memcpy(&msg_buf[0], &val, sizeof(float));
-    memcpy(&msg_buf[4], name, name_len);
+    uint16_t msg_len = uavcan_encode_key_value(msg_buf, val, name);
     static uint8_t transfer_id;
-    canardBroadcast(&canard, UAVCAN_DEBUG_KEYVALUE_DATA_TYPE_SIGNATURE, UAVCAN_DEBUG_KEYVALUE_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOWEST, msg_buf, sizeof(float)+name_len);
+    count_transfer_tx(canardBroadcast(&canard, UAVCAN_DEBUG_KEYVALUE_DATA_TYPE_SIGNATURE, UAVCAN_DEBUG_KEYVALUE_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOWEST, msg_buf, msg_len));
 }
 
 void uavcan_send_debug_logmessage(enum uavcan_loglevel_t log_level, const char* source, const char* text) {
     uint8_t msg_buf[UAVCAN_DEBUG_LOGMESSAGE_MESSAGE_MAX_SIZE];
-
-    size_t source_len = strlen(source);
-    size_t text_len = strlen(text);
-
-    if (source_len > 31) {
-        source_len = 31;
-    }
-    if (text_len > 90) {
-        text_len = 90;
-    }
-
-    uint8_t source_len_uint8 = source_len;
-
-    canardEncodeScalar(msg_buf, 0, 3, &log_level);
-    canardEncodeScalar(msg_buf, 3, 5, &source_len_uint8);
-    memcpy(&msg_buf[1], source, source_len);
-    memcpy(&msg_buf[1+source_len], text, text_len);
+    uint16_t msg_len = uavcan_encode_log_message(msg_buf, log_level, source, text);
     static uint8_t transfer_id;
-    canardBroadcast(&canard, UAVCAN_DEBUG_LOGMESSAGE_DATA_TYPE_SIGNATURE, UAVCAN_DEBUG_LOGMESSAGE_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOWEST, msg_buf, 1+source_len+text_len);
+    count_transfer_tx(canardBroadcast(&canard, UAVCAN_DEBUG_LOGMESSAGE_DATA_TYPE_SIGNATURE, UAVCAN_DEBUG_LOGMESSAGE_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOWEST, msg_buf, msg_len));
 }
 
 // Node ID allocation - implementation of http://uavcan.org/Specification/figures/dynamic_node_id_allocatee_algorithm.svg
@@ -253,6 +399,8 @@ static void allocation_init(void)
         return;
     }
 
+    allocation_state.started_us = micros();
+
     // Start request timer
     allocation_start_request_timer();
 }
@@ -282,17 +430,19 @@ static void allocation_timer_expired(void)
     // Send allocation message
     uint8_t allocation_request[CANARD_CAN_FRAME_MAX_DATA_LEN - 1];
     uint8_t uid_size = MIN(UNIQUE_ID_LENGTH_BYTES-allocation_state.unique_id_offset, UAVCAN_NODE_ID_ALLOCATION_MAX_LENGTH_OF_UID_IN_REQUEST);
-    allocation_request[0] = (allocation_state.unique_id_offset == 0) ? 1 : 0;
-    memcpy(&allocation_request[1], &node_unique_id[allocation_state.unique_id_offset], uid_size);
+    uint16_t request_len = uavcan_encode_allocation_request(allocation_request, allocation_state.preferred_node_id, allocation_state.unique_id_offset == 0, &node_unique_id[allocation_state.unique_id_offset], uid_size);
 
     static uint8_t transfer_id;
-    canardBroadcast(&canard, UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_SIGNATURE, UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOW, allocation_request, uid_size+1);
+    count_transfer_tx(canardBroadcast(&canard, UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_SIGNATURE, UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOW, allocation_request, request_len));
 
     allocation_state.unique_id_offset = 0;
+    allocation_state.last_request_us = micros();
+    allocation_state.request_sent = true;
 }
 
 static void handle_allocation_data_broadcast(CanardInstance* ins, CanardRxTransfer* transfer)
 {
+    UNUSED(ins);
     if (!allocation_running()) {
         return;
     }
@@ -306,15 +456,14 @@ static void handle_allocation_data_broadcast(CanardInstance* ins, CanardRxTransf
         return;
     }
 
-    uint8_t received_unique_id[UNIQUE_ID_LENGTH_BYTES];
-    uint8_t received_unique_id_len = transfer->payload_len-1;
-    uint8_t i;
-    for (i=0; i<received_unique_id_len; i++)
-    {
-        canardDecodeScalar(transfer, i*8+UAVCAN_NODE_ID_ALLOCATION_UID_BIT_OFFSET, 8, false, &received_unique_id[i]);
+    uint8_t payload[UAVCAN_ALLOCATION_UNIQUE_ID_OFS+UNIQUE_ID_LENGTH_BYTES];
+    uint16_t payload_len = copy_transfer_payload(transfer, payload, sizeof(payload));
+    if (payload_len < UAVCAN_ALLOCATION_UNIQUE_ID_OFS) {
+        return;
     }
+    uint8_t received_unique_id_len = payload_len-UAVCAN_ALLOCATION_UNIQUE_ID_OFS;
 
-    if(memcmp(node_unique_id, received_unique_id, received_unique_id_len) != 0)
+    if(memcmp(node_unique_id, &payload[UAVCAN_ALLOCATION_UNIQUE_ID_OFS], received_unique_id_len) != 0)
     {
         // If unique ID does not match, return
         return;
@@ -326,10 +475,10 @@ static void handle_allocation_data_broadcast(CanardInstance* ins, CanardRxTransf
         allocation_start_followup_timer();
     } else {
         // Complete match received
-        uint8_t allocated_node_id = 0;
-        canardDecodeScalar(transfer, 0, 7, false, &allocated_node_id);
+        uint8_t allocated_node_id = uavcan_decode_allocation_node_id(payload);
         if (allocated_node_id != 0) {
-            canardSetLocalNodeID(ins, allocated_node_id);
+            allocation_state.time_to_id_us = micros() - allocation_state.started_us;
+            set_local_node_id(allocated_node_id);
         }
     }
 }
@@ -341,7 +490,13 @@ static void allocation_start_request_timer(void)
     }
 
     allocation_state.request_timer_begin_us = micros();
-    allocation_state.request_delay_us = UAVCAN_NODE_ID_ALLOCATION_MIN_REQUEST_PERIOD_US + (uint32_t)(getRandomFloat() * (UAVCAN_NODE_ID_ALLOCATION_MAX_REQUEST_PERIOD_US-UAVCAN_NODE_ID_ALLOCATION_MIN_REQUEST_PERIOD_US));
+    if (!allocation_state.request_sent && allocation_state.preferred_node_id != 0) {
+        // a node that knows its previous ID is most likely just rebooting, not joining a bus full of
+        // anonymous nodes - open with a follow-up length delay instead of a full request period
+        allocation_state.request_delay_us = UAVCAN_NODE_ID_ALLOCATION_MIN_FOLLOWUP_PERIOD_US + (uint32_t)(getRandomFloat() * (UAVCAN_NODE_ID_ALLOCATION_MAX_FOLLOWUP_PERIOD_US-UAVCAN_NODE_ID_ALLOCATION_MIN_FOLLOWUP_PERIOD_US));
+    } else {
+        allocation_state.request_delay_us = UAVCAN_NODE_ID_ALLOCATION_MIN_REQUEST_PERIOD_US + (uint32_t)(getRandomFloat() * (UAVCAN_NODE_ID_ALLOCATION_MAX_REQUEST_PERIOD_US-UAVCAN_NODE_ID_ALLOCATION_MIN_REQUEST_PERIOD_US));
+    }
 }
 
 static void allocation_start_followup_timer(void)
@@ -351,7 +506,11 @@ static void allocation_start_followup_timer(void)
     }
 
     allocation_state.request_timer_begin_us = micros();
-    allocation_state.request_delay_us = UAVCAN_NODE_ID_ALLOCATION_MIN_FOLLOWUP_PERIOD_US + (uint32_t)(getRandomFloat() * (UAVCAN_NODE_ID_ALLOCATION_MAX_FOLLOWUP_PERIOD_US-UAVCAN_NODE_ID_ALLOCATION_MIN_FOLLOWUP_PERIOD_US));
+    if (allocation_state.request_timer_begin_us - allocation_state.last_request_us < UAVCAN_NODE_ID_ALLOCATION_FAST_RESPONSE_US) {
+        allocation_state.request_delay_us = UAVCAN_NODE_ID_ALLOCATION_MIN_FOLLOWUP_PERIOD_US;
+    } else {
+        allocation_state.request_delay_us = UAVCAN_NODE_ID_ALLOCATION_MIN_FOLLOWUP_PERIOD_US + (uint32_t)(getRandomFloat() * (UAVCAN_NODE_ID_ALLOCATION_MAX_FOLLOWUP_PERIOD_US-UAVCAN_NODE_ID_ALLOCATION_MIN_FOLLOWUP_PERIOD_US));
+    }
 }
 
 static bool allocation_running(void)
@@ -369,49 +528,56 @@ static void process1HzTasks(void)
 
         static uint8_t transfer_id;
 
-        canardBroadcast(&canard, UAVCAN_NODE_STATUS_DATA_TYPE_SIGNATURE, UAVCAN_NODE_STATUS_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOWEST, buffer, UAVCAN_NODE_STATUS_MESSAGE_SIZE);
+        count_transfer_tx(canardBroadcast(&canard, UAVCAN_NODE_STATUS_DATA_TYPE_SIGNATURE, UAVCAN_NODE_STATUS_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOWEST, buffer, UAVCAN_NODE_STATUS_MESSAGE_SIZE));
     }
 }
 
 static void handle_get_node_info_request(CanardInstance* ins, CanardRxTransfer* transfer)
 {
-    uint8_t buffer[UAVCAN_GET_NODE_INFO_RESPONSE_MAX_SIZE];
-    memset(buffer, 0, UAVCAN_GET_NODE_INFO_RESPONSE_MAX_SIZE);
-    makeNodeStatusMessage(buffer);
-
-    // Software Version
-    buffer[7] = node_info.sw_major_version;
-    buffer[8] = node_info.sw_minor_version;
-
-    if (node_info.sw_vcs_commit_available) {
-        buffer[9] |= 1; // set OPTIONAL_FIELD_FLAG_VCS_COMMIT
-        canardEncodeScalar(buffer, 80, 32, &node_info.sw_vcs_commit);
-    }
-
-    if (node_info.sw_image_crc_available) {
-        buffer[9] |= 2; // set OPTIONAL_FIELD_FLAG_IMAGE_CRC
-        canardEncodeScalar(buffer, 112, 64, &node_info.sw_image_crc);
+    uint8_t node_status[UAVCAN_NODE_STATUS_MESSAGE_SIZE];
+    makeNodeStatusMessage(node_status);
+
+    if (node_info_response_dirty) {
+        node_info_response_len = uavcan_encode_get_node_info_response(node_info_response, node_status,
+            node_info.sw_major_version, node_info.sw_minor_version,
+            node_info.sw_vcs_commit_available, node_info.sw_vcs_commit,
+            node_info.sw_image_crc_available, node_info.sw_image_crc,
+            node_info.hw_major_version, node_info.hw_minor_version,
+            node_unique_id, node_info.hw_name);
+        node_info_response_dirty = false;
+    } else {
+        memcpy(node_info_response, node_status, UAVCAN_NODE_STATUS_MESSAGE_SIZE);
     }
 
-    buffer[22] = node_info.hw_major_version;
-    buffer[23] = node_info.hw_minor_version;
+    count_transfer_tx(canardRequestOrRespond(ins, transfer->source_node_id, UAVCAN_GET_NODE_INFO_DATA_TYPE_SIGNATURE, UAVCAN_GET_NODE_INFO_DATA_TYPE_ID, &transfer->transfer_id, transfer->priority, CanardResponse, node_info_response, node_info_response_len));
+}
 
-    // Unique ID
-    memcpy(&buffer[24], node_unique_id, sizeof(node_unique_id));
+static void handle_get_transport_stats_request(CanardInstance* ins, CanardRxTransfer* transfer)
+{
+    struct canbus_stats_s can_stats;
+    canbus_get_stats(&can_stats);
 
-    // Name
-    const size_t name_len = strlen(node_info.hw_name);
-    memcpy(&buffer[41], node_info.hw_name, name_len);
+    const uint64_t fields[UAVCAN_GET_TRANSPORT_STATS_NUM_FIELDS] = {
+        transfers_tx,
+        transfers_rx,
+        transfer_errors,
+        // CANIfaceStats[0], the tail array needs no length prefix
+        can_stats.frames_tx,
+        can_stats.frames_rx,
+        (uint64_t)can_stats.errors + can_stats.rx_overruns + can_stats.bus_off_events
+    };
 
-    const size_t total_size = 41 + name_len;
+    uint8_t buffer[UAVCAN_GET_TRANSPORT_STATS_SIZE];
+    uavcan_encode_get_transport_stats_response(buffer, fields);
 
-    canardRequestOrRespond(ins, transfer->source_node_id, UAVCAN_GET_NODE_INFO_DATA_TYPE_SIGNATURE, UAVCAN_GET_NODE_INFO_DATA_TYPE_ID, &transfer->transfer_id, transfer->priority, CanardResponse, buffer, total_size);
+    count_transfer_tx(canardRequestOrRespond(ins, transfer->source_node_id, UAVCAN_GET_TRANSPORT_STATS_DATA_TYPE_SIGNATURE, UAVCAN_GET_TRANSPORT_STATS_DATA_TYPE_ID, &transfer->transfer_id, transfer->priority, CanardResponse, buffer, sizeof(buffer)));
 }
 
 static void handle_restart_node_request(CanardInstance* ins, CanardRxTransfer* transfer)
 {
-    uint64_t magic;
-    canardDecodeScalar(transfer, 0, 40, false, &magic);
+    uint8_t payload[UAVCAN_RESTART_NODE_REQUEST_SIZE] = {0};
+    copy_transfer_payload(transfer, payload, sizeof(payload));
+    uint64_t magic = uavcan_decode_restart_node_request(payload);
     if (restart_cb) {
         restart_cb(get_transfer_info(ins, transfer), magic);
     }
@@ -420,22 +586,19 @@ static void handle_restart_node_request(CanardInstance* ins, CanardRxTransfer* t
 void uavcan_send_restart_response(struct uavcan_transfer_info_s* transfer_info, bool ok)
 {
     uint8_t resp_buf[UAVCAN_RESTARTNODE_RESPONSE_MAX_SIZE];
-    canardEncodeScalar(resp_buf, 0, 1, &ok);
+    uavcan_encode_restart_node_response(resp_buf, ok);
 
-    canardRequestOrRespond(transfer_info->canardInstance, transfer_info->remote_node_id, UAVCAN_RESTARTNODE_DATA_TYPE_SIGNATURE, UAVCAN_RESTARTNODE_DATA_TYPE_ID, &transfer_info->transfer_id, transfer_info->priority, CanardResponse, resp_buf, UAVCAN_RESTARTNODE_RESPONSE_MAX_SIZE);
+    count_transfer_tx(canardRequestOrRespond(transfer_info->canardInstance, transfer_info->remote_node_id, UAVCAN_RESTARTNODE_DATA_TYPE_SIGNATURE, UAVCAN_RESTARTNODE_DATA_TYPE_ID, &transfer_info->transfer_id, transfer_info->priority, CanardResponse, resp_buf, UAVCAN_RESTARTNODE_RESPONSE_MAX_SIZE));
 }
 
 static void handle_file_beginfirmwareupdate_request(CanardInstance* ins, CanardRxTransfer* transfer)
 {
-    uint8_t source_node_id;
-    canardDecodeScalar(transfer, 0, 8, false, &source_node_id);
-    uint8_t path_len = transfer->payload_len-1;
-    char path[201];
+    uint8_t payload[UAVCAN_FILE_BEGINFIRMWAREUPDATE_REQUEST_MAX_SIZE];
+    uint16_t payload_len = copy_transfer_payload(transfer, payload, sizeof(payload));
 
-    for(uint8_t i=0; i<path_len; i++) {
-        canardDecodeScalar(transfer, 8+i*8, 8, false, (uint8_t*)&path[i]);
-    }
-    path[path_len] = '\0';
+    uint8_t source_node_id;
+    char path[UAVCAN_BEGIN_FIRMWARE_UPDATE_PATH_MAX_LEN+1];
+    uavcan_decode_begin_firmware_update_request(payload, payload_len, &source_node_id, path);
 
     if (file_beginfirmwareupdate_cb) {
         file_beginfirmwareupdate_cb(get_transfer_info(ins, transfer), source_node_id, path);
@@ -448,30 +611,20 @@ static void handle_file_beginfirmwareupdate_request(CanardInstance* ins, CanardR
 void uavcan_send_file_beginfirmwareupdate_response(struct uavcan_transfer_info_s* transfer_info, enum uavcan_beginfirmwareupdate_error_t error, const char* error_message)
 {
     uint8_t buf[UAVCAN_FILE_BEGINFIRMWAREUPDATE_RESPONSE_MAX_SIZE];
+    uint16_t total_size = uavcan_encode_begin_firmware_update_response(buf, (uint8_t)error, error_message);
 
-    buf[0] = (uint8_t)error;
-    size_t error_message_len = strlen(error_message);
-    memcpy(&buf[1], error_message, error_message_len);
-
-    size_t total_size = error_message_len+1;
-
-    canardRequestOrRespond(transfer_info->canardInstance, transfer_info->remote_node_id, UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_SIGNATURE, UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_ID, &transfer_info->transfer_id, transfer_info->priority, CanardResponse, buf, total_size);
+    count_transfer_tx(canardRequestOrRespond(transfer_info->canardInstance, transfer_info->remote_node_id, UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_SIGNATURE, UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_ID, &transfer_info->transfer_id, transfer_info->priority, CanardResponse, buf, total_size));
 }
 
 
 static uint8_t file_read_transfer_id;
 uint8_t uavcan_send_file_read_request(uint8_t remote_node_id, const uint64_t offset, const char* path)
 {
-    uint8_t buf[UAVCAN_FILE_BEGINFIRMWAREUPDATE_RESPONSE_MAX_SIZE];
-
-    canardEncodeScalar(buf, 0, 40, &offset);
-    size_t path_len = strlen(path);
-    memcpy(&buf[5], path, path_len);
-
-    size_t total_size = path_len+5;
+    uint8_t buf[UAVCAN_FILE_READ_REQUEST_MAX_SIZE];
+    uint16_t total_size = uavcan_encode_file_read_request(buf, offset, path);
 
     uint8_t transfer_id = file_read_transfer_id;
-    canardRequestOrRespond(&canard, remote_node_id, UAVCAN_FILE_READ_DATA_TYPE_SIGNATURE, UAVCAN_FILE_READ_DATA_TYPE_ID, &file_read_transfer_id, CANARD_TRANSFER_PRIORITY_LOWEST, CanardRequest, buf, total_size);
+    count_transfer_tx(canardRequestOrRespond(&canard, remote_node_id, UAVCAN_FILE_READ_DATA_TYPE_SIGNATURE, UAVCAN_FILE_READ_DATA_TYPE_ID, &file_read_transfer_id, CANARD_TRANSFER_PRIORITY_LOWEST, CanardRequest, buf, total_size));
 
     return transfer_id;
 }
@@ -479,90 +632,123 @@ uint8_t uavcan_send_file_read_request(uint8_t remote_node_id, const uint64_t off
 static void handle_file_read_response(CanardInstance* ins, CanardRxTransfer* transfer)
 {
     UNUSED(ins);
-    int16_t error;
-    uint8_t data[256];
-    size_t data_len = transfer->payload_len-2;
-    canardDecodeScalar(transfer, 0, 16, true, &error);
-
-    for(uint16_t i=0; i<data_len; i++) {
-        canardDecodeScalar(transfer, 16+i*8, 8, false, &data[i]);
+    if (transfer->payload_len < UAVCAN_FILE_READ_DATA_OFS) {
+        return;
     }
 
+    uint8_t header[UAVCAN_FILE_READ_DATA_OFS];
+    copy_transfer_payload(transfer, header, sizeof(header));
+    int16_t error = uavcan_decode_file_read_response_error(header);
+
+    // the data is byte aligned, it is copied straight out of canard's buffers by the handler
+    const struct uavcan_rx_payload_s data = { transfer, UAVCAN_FILE_READ_DATA_OFS };
+    uint16_t data_len = transfer->payload_len-UAVCAN_FILE_READ_DATA_OFS;
+
     if (file_read_response_cb) {
-        file_read_response_cb(transfer->transfer_id, error, data, data_len, data_len<256);
+        file_read_response_cb(transfer->transfer_id, error, &data, data_len, data_len<256);
+    }
+}
+
+// gathers up to len bytes of the payload into buf for the uavcan_codecs.h decoders, returns the number copied
+static uint16_t copy_transfer_payload(CanardRxTransfer* transfer, uint8_t* buf, uint16_t len)
+{
+    const struct uavcan_rx_payload_s payload = { transfer, 0 };
+    len = MIN(len, transfer->payload_len);
+    uavcan_rx_payload_copy(&payload, buf, len);
+    return len;
+}
+
+// canardBroadcast and canardRequestOrRespond return the number of frames queued or a negative error
+static void count_transfer_tx(int result)
+{
+    if (result > 0) {
+        transfers_tx++;
+    } else {
+        transfer_errors++;
     }
 }
 
+static uint32_t transfer_handler_key(CanardTransferType transfer_type, uint16_t data_type_id)
+{
+    return (uint32_t)transfer_type << 16 | data_type_id;
+}
+
+static void sort_transfer_handlers(void)
+{
+    // insertion sort, the table is a handful of entries
+    for (uint8_t i=0; i<NUM_TRANSFER_HANDLERS; i++) {
+        const struct transfer_handler_s* h = &transfer_handlers[i];
+        const uint32_t key = transfer_handler_key(h->transfer_type, h->data_type_id);
+
+        uint8_t j = i;
+        while (j > 0) {
+            const struct transfer_handler_s* prev = &transfer_handlers[sorted_transfer_handlers[j-1]];
+            if (transfer_handler_key(prev->transfer_type, prev->data_type_id) <= key) {
+                break;
+            }
+            sorted_transfer_handlers[j] = sorted_transfer_handlers[j-1];
+            j--;
+        }
+        sorted_transfer_handlers[j] = i;
+    }
+}
+
+static const struct transfer_handler_s* find_transfer_handler(CanardTransferType transfer_type, uint16_t data_type_id)
+{
+    const uint32_t key = transfer_handler_key(transfer_type, data_type_id);
+
+    uint8_t lo = 0;
+    uint8_t hi = NUM_TRANSFER_HANDLERS;
+    while (lo < hi) {
+        uint8_t mid = (lo+hi)/2;
+        const struct transfer_handler_s* h = &transfer_handlers[sorted_transfer_handlers[mid]];
+        uint32_t mid_key = transfer_handler_key(h->transfer_type, h->data_type_id);
+
+        if (mid_key == key) {
+            return h;
+        } else if (mid_key < key) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
 static void onTransferReceived(CanardInstance* ins, CanardRxTransfer* transfer)
 {
-    if (transfer->transfer_type == CanardTransferTypeBroadcast && transfer->data_type_id == UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_ID) {
-        handle_allocation_data_broadcast(ins, transfer);
-    } else if (transfer->transfer_type == CanardTransferTypeRequest && transfer->data_type_id == UAVCAN_GET_NODE_INFO_DATA_TYPE_ID) {
-        handle_get_node_info_request(ins, transfer);
-    } else if (transfer->transfer_type == CanardTransferTypeRequest && transfer->data_type_id == UAVCAN_RESTARTNODE_DATA_TYPE_ID) {
-        handle_restart_node_request(ins, transfer);
-    } else if (transfer->transfer_type == CanardTransferTypeRequest && transfer->data_type_id == UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_ID) {
-        handle_file_beginfirmwareupdate_request(ins, transfer);
-    } else if (transfer->transfer_type == CanardTransferTypeResponse && transfer->data_type_id == UAVCAN_FILE_READ_DATA_TYPE_ID) {
-        handle_file_read_response(ins, transfer);
+    transfers_rx++;
+
+    const struct transfer_handler_s* h = find_transfer_handler((CanardTransferType)transfer->transfer_type, transfer->data_type_id);
+    if (h) {
+        h->handler(ins, transfer);
     }
 }
 
 static void makeNodeStatusMessage(uint8_t* buffer)
 {
-    memset(buffer, 0, UAVCAN_NODE_STATUS_MESSAGE_SIZE);
-
     if (started_at_sec == 0) {
         started_at_sec = millis()/1000U;
     }
 
     const uint32_t uptime_sec = millis()/1000U - started_at_sec;
 
-    canardEncodeScalar(buffer,  0, 32, &uptime_sec);
-    canardEncodeScalar(buffer, 32,  2, &node_health);
-    canardEncodeScalar(buffer, 34,  3, &node_mode);
+    uavcan_encode_node_status(buffer, uptime_sec, node_health, node_mode, 0, node_vendor_status);
 }
 
 static bool shouldAcceptTransfer(const CanardInstance* ins, uint64_t* out_data_type_signature, uint16_t data_type_id, CanardTransferType transfer_type, uint8_t source_node_id)
 {
     UNUSED(ins);
     UNUSED(source_node_id);
-    if (allocation_running())
-    {
-        if ((transfer_type == CanardTransferTypeBroadcast) &&
-            (data_type_id == UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_ID))
-        {
-            *out_data_type_signature = UAVCAN_NODE_ID_ALLOCATION_DATA_TYPE_SIGNATURE;
-            return true;
-        }
-        return false;
-    }
-
-    if (transfer_type == CanardTransferTypeRequest && data_type_id == UAVCAN_GET_NODE_INFO_DATA_TYPE_ID)
-    {
-        *out_data_type_signature = UAVCAN_GET_NODE_INFO_DATA_TYPE_SIGNATURE;
-        return true;
-    }
-
-    if (transfer_type == CanardTransferTypeRequest && data_type_id == UAVCAN_RESTARTNODE_DATA_TYPE_ID)
-    {
-        *out_data_type_signature = UAVCAN_RESTARTNODE_DATA_TYPE_SIGNATURE;
-        return true;
-    }
-
-    if (transfer_type == CanardTransferTypeRequest && data_type_id == UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_ID)
-    {
-        *out_data_type_signature = UAVCAN_FILE_BEGINFIRMWAREUPDATE_DATA_TYPE_SIGNATURE;
-        return true;
-    }
 
-    if (transfer_type == CanardTransferTypeResponse && data_type_id == UAVCAN_FILE_READ_DATA_TYPE_ID)
-    {
-        *out_data_type_signature = UAVCAN_FILE_READ_DATA_TYPE_SIGNATURE;
-        return true;
+    const struct transfer_handler_s* h = find_transfer_handler(transfer_type, data_type_id);
+    if (!h || h->during_allocation != allocation_running()) {
+        return false;
     }
 
-    return false;
+    *out_data_type_signature = h->data_type_signature;
+    return true;
 }
 
 static float getRandomFloat(void)
@@ -51,9 +51,15 @@ struct uavcan_node_info_s {
     uint64_t sw_image_crc;
 };
 
+// payload bytes left where the CAN stack buffered them, only valid during the callback that received it
+struct uavcan_rx_payload_s {
+    const void* transfer;
+    uint16_t ofs;
+};
+
 typedef void (*restart_handler_ptr)(struct uavcan_transfer_info_s transfer_info, uint64_t magic);
 typedef void (*file_beginfirmwareupdate_handler_ptr)(struct uavcan_transfer_info_s transfer_info, uint8_t source_node_id, const char* path);
-typedef void (*file_read_response_handler_ptr)(uint8_t transfer_id, int16_t error, const uint8_t* data, uint16_t data_len, bool eof);
+typedef void (*file_read_response_handler_ptr)(uint8_t transfer_id, int16_t error, const struct uavcan_rx_payload_s* data, uint16_t data_len, bool eof);
 typedef void (*uavcan_ready_handler_ptr)(void);
 
 void uavcan_init(void);
@@ -64,9 +70,14 @@ void uavcan_set_file_beginfirmwareupdate_cb(file_beginfirmwareupdate_handler_ptr
 void uavcan_set_file_read_response_cb(file_read_response_handler_ptr cb);
 void uavcan_set_node_mode(enum uavcan_node_mode_t mode);
 void uavcan_set_node_health(enum uavcan_node_health_t health);
+void uavcan_set_node_vendor_status(uint16_t vendor_status);
 void uavcan_set_node_id(uint8_t node_id);
+void uavcan_set_preferred_node_id(uint8_t node_id);
 uint8_t uavcan_get_node_id(void);
-void uavcan_set_node_info(struct uavcan_node_info_s new_node_info);
+uint32_t uavcan_get_node_id_allocation_time_us(void);
+void uavcan_set_node_info(const struct uavcan_node_info_s* new_node_info);
+
+void uavcan_rx_payload_copy(const struct uavcan_rx_payload_s* payload, void* dst, uint16_t len);
 
 void uavcan_send_debug_key_value(const char* name, float val);
 void uavcan_send_debug_logmessage(enum uavcan_loglevel_t log_level, const char* source, const char* text);
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Fixed layout encoders and decoders for the UAVCAN v0 types the bootloader speaks. Byte aligned fields are plain
+// little endian stores, the few sub-byte fields are packed from the most significant bit down as in the DSDL bit
+// stream. Buffers are flat - multi-frame payloads are gathered with uavcan_rx_payload_copy first.
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "uavcan_codecs.h stores multi-byte fields in host byte order"
+#endif
+
+#define UAVCAN_CODEC_MIN(a,b) ((a) < (b) ? (a) : (b))
+
+// uavcan.protocol.NodeStatus
+#define UAVCAN_NODE_STATUS_SIZE                         7
+
+// uavcan.protocol.GetNodeInfo response
+#define UAVCAN_GET_NODE_INFO_SW_VERSION_OFS             7
+#define UAVCAN_GET_NODE_INFO_SW_FLAG_VCS_COMMIT         1
+#define UAVCAN_GET_NODE_INFO_SW_FLAG_IMAGE_CRC          2
+#define UAVCAN_GET_NODE_INFO_HW_VERSION_OFS             22
+#define UAVCAN_GET_NODE_INFO_UNIQUE_ID_LEN              16
+#define UAVCAN_GET_NODE_INFO_NAME_OFS                   41
+#define UAVCAN_GET_NODE_INFO_NAME_MAX_LEN               80
+
+// uavcan.protocol.GetTransportStats response with one CANIfaceStats entry
+#define UAVCAN_GET_TRANSPORT_STATS_NUM_FIELDS           6
+#define UAVCAN_GET_TRANSPORT_STATS_SIZE                 (UAVCAN_GET_TRANSPORT_STATS_NUM_FIELDS*6)
+
+// uavcan.protocol.RestartNode
+#define UAVCAN_RESTART_NODE_REQUEST_SIZE                5
+#define UAVCAN_RESTART_NODE_RESPONSE_SIZE               1
+
+// uavcan.protocol.file.BeginFirmwareUpdate
+#define UAVCAN_BEGIN_FIRMWARE_UPDATE_PATH_MAX_LEN       200
+#define UAVCAN_BEGIN_FIRMWARE_UPDATE_MESSAGE_MAX_LEN    127
+
+// uavcan.protocol.file.Read
+#define UAVCAN_FILE_READ_PATH_MAX_LEN                   200
+#define UAVCAN_FILE_READ_DATA_OFS                       2
+
+// uavcan.protocol.dynamic_node_id.Allocation
+#define UAVCAN_ALLOCATION_UNIQUE_ID_OFS                 1
+
+// uavcan.protocol.debug.KeyValue
+#define UAVCAN_KEY_VALUE_NAME_MAX_LEN                   58
+
+// uavcan.protocol.debug.LogMessage
+#define UAVCAN_LOG_MESSAGE_SOURCE_MAX_LEN               31
+#define UAVCAN_LOG_MESSAGE_TEXT_MAX_LEN                 90
+
+static inline void uavcan_codec_put_le(uint8_t* buf, uint64_t value, uint8_t num_bytes)
+{
+    memcpy(buf, &value, num_bytes);
+}
+
+static inline uint64_t uavcan_codec_get_le(const uint8_t* buf, uint8_t num_bytes)
+{
+    uint64_t value = 0;
+    memcpy(&value, buf, num_bytes);
+    return value;
+}
+
+static inline uint16_t uavcan_codec_put_string(uint8_t* buf, const char* str, uint16_t max_len)
+{
+    uint16_t len = UAVCAN_CODEC_MIN(strlen(str), max_len);
+    memcpy(buf, str, len);
+    return len;
+}
+
+static inline void uavcan_encode_node_status(uint8_t* buf, uint32_t uptime_sec, uint8_t health, uint8_t mode, uint8_t sub_mode, uint16_t vendor_status)
+{
+    uavcan_codec_put_le(&buf[0], uptime_sec, 4);
+    buf[4] = (uint8_t)((health & 0x3) << 6 | (mode & 0x7) << 3 | (sub_mode & 0x7));
+    uavcan_codec_put_le(&buf[5], vendor_status, 2);
+}
+
+// returns the response length, the name is the tail array
+static inline uint16_t uavcan_encode_get_node_info_response(uint8_t* buf, const uint8_t* node_status,
+    uint8_t sw_major, uint8_t sw_minor, bool vcs_commit_available, uint32_t vcs_commit, bool image_crc_available, uint64_t image_crc,
+    uint8_t hw_major, uint8_t hw_minor, const uint8_t* unique_id, const char* name)
+{
+    memcpy(&buf[0], node_status, UAVCAN_NODE_STATUS_SIZE);
+
+    uint8_t* sw = &buf[UAVCAN_GET_NODE_INFO_SW_VERSION_OFS];
+    sw[0] = sw_major;
+    sw[1] = sw_minor;
+    sw[2] = (vcs_commit_available ? UAVCAN_GET_NODE_INFO_SW_FLAG_VCS_COMMIT : 0) | (image_crc_available ? UAVCAN_GET_NODE_INFO_SW_FLAG_IMAGE_CRC : 0);
+    uavcan_codec_put_le(&sw[3], vcs_commit_available ? vcs_commit : 0, 4);
+    uavcan_codec_put_le(&sw[7], image_crc_available ? image_crc : 0, 8);
+
+    uint8_t* hw = &buf[UAVCAN_GET_NODE_INFO_HW_VERSION_OFS];
+    hw[0] = hw_major;
+    hw[1] = hw_minor;
+    memcpy(&hw[2], unique_id, UAVCAN_GET_NODE_INFO_UNIQUE_ID_LEN);
+    hw[2+UAVCAN_GET_NODE_INFO_UNIQUE_ID_LEN] = 0; // certificate_of_authenticity length
+
+    return UAVCAN_GET_NODE_INFO_NAME_OFS + uavcan_codec_put_string(&buf[UAVCAN_GET_NODE_INFO_NAME_OFS], name, UAVCAN_GET_NODE_INFO_NAME_MAX_LEN);
+}
+
+// all fields are uint48: transfers_tx, transfers_rx, transfer_errors, then frames_tx, frames_rx, errors of the interface
+static inline void uavcan_encode_get_transport_stats_response(uint8_t* buf, const uint64_t* fields)
+{
+    for (uint8_t i=0; i<UAVCAN_GET_TRANSPORT_STATS_NUM_FIELDS; i++) {
+        uavcan_codec_put_le(&buf[i*6], fields[i], 6);
+    }
+}
+
+static inline uint64_t uavcan_decode_restart_node_request(const uint8_t* buf)
+{
+    return uavcan_codec_get_le(buf, 5);
+}
+
+static inline void uavcan_encode_restart_node_response(uint8_t* buf, bool ok)
+{
+    buf[0] = ok ? 0x80 : 0;
+}
+
+// path must hold UAVCAN_BEGIN_FIRMWARE_UPDATE_PATH_MAX_LEN+1 chars
+static inline void uavcan_decode_begin_firmware_update_request(const uint8_t* buf, uint16_t len, uint8_t* source_node_id, char* path)
+{
+    *source_node_id = len > 0 ? buf[0] : 0;
+    uint16_t path_len = len > 0 ? UAVCAN_CODEC_MIN(len-1, UAVCAN_BEGIN_FIRMWARE_UPDATE_PATH_MAX_LEN) : 0;
+    memcpy(path, &buf[1], path_len);
+    path[path_len] = '\0';
+}
+
+static inline uint16_t uavcan_encode_begin_firmware_update_response(uint8_t* buf, uint8_t error, const char* error_message)
+{
+    buf[0] = error;
+    return 1 + uavcan_codec_put_string(&buf[1], error_message, UAVCAN_BEGIN_FIRMWARE_UPDATE_MESSAGE_MAX_LEN);
+}
+
+static inline uint16_t uavcan_encode_file_read_request(uint8_t* buf, uint64_t offset, const char* path)
+{
+    uavcan_codec_put_le(&buf[0], offset, 5);
+    return 5 + uavcan_codec_put_string(&buf[5], path, UAVCAN_FILE_READ_PATH_MAX_LEN);
+}
+
+// the data that follows at UAVCAN_FILE_READ_DATA_OFS is left in place
+static inline int16_t uavcan_decode_file_read_response_error(const uint8_t* buf)
+{
+    return (int16_t)uavcan_codec_get_le(buf, 2);
+}
+
+// node_id is the preferred node ID, 0 for any
+static inline uint16_t uavcan_encode_allocation_request(uint8_t* buf, uint8_t node_id, bool first_part_of_unique_id, const uint8_t* unique_id_part, uint8_t len)
+{
+    buf[0] = (uint8_t)((node_id & 0x7f) << 1 | (first_part_of_unique_id ? 1 : 0));
+    memcpy(&buf[UAVCAN_ALLOCATION_UNIQUE_ID_OFS], unique_id_part, len);
+    return UAVCAN_ALLOCATION_UNIQUE_ID_OFS + len;
+}
+
+static inline uint8_t uavcan_decode_allocation_node_id(const uint8_t* buf)
+{
+    return buf[0] >> 1;
+}
+
+static inline uint16_t uavcan_encode_key_value(uint8_t* buf, float value, const char* name)
+{
+    memcpy(&buf[0], &value, sizeof(value));
+    return sizeof(value) + uavcan_codec_put_string(&buf[sizeof(value)], name, UAVCAN_KEY_VALUE_NAME_MAX_LEN);
+}
+
+static inline uint16_t uavcan_encode_log_message(uint8_t* buf, uint8_t level, const char* source, const char* text)
+{
+    uint16_t source_len = uavcan_codec_put_string(&buf[1], source, UAVCAN_LOG_MESSAGE_SOURCE_MAX_LEN);
+    buf[0] = (uint8_t)((level & 0x7) << 5 | source_len);
+    return 1 + source_len + uavcan_codec_put_string(&buf[1+source_len], text, UAVCAN_LOG_MESSAGE_TEXT_MAX_LEN);
+}
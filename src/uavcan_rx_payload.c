@@ -0,0 +1,54 @@
+#include <uavcan.h>
+#include <canard.h>
+#include <string.h>
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+// memcpy for byte aligned payload fields, one call per contiguous span instead of canardDecodeScalar per byte
+void uavcan_rx_payload_copy(const struct uavcan_rx_payload_s* payload, void* dst, uint16_t len)
+{
+    const CanardRxTransfer* transfer = payload->transfer;
+    uint8_t* out = dst;
+    uint16_t ofs = payload->ofs;
+
+    if (ofs >= transfer->payload_len) {
+        return;
+    }
+    len = MIN(len, transfer->payload_len-ofs);
+
+    if (transfer->payload_middle == NULL && transfer->payload_tail == NULL) {
+        // single frame, or two frames whose bytes all fit the head
+        memcpy(out, &transfer->payload_head[ofs], len);
+        return;
+    }
+
+    // Laid out as canard's own descatterTransferPayload reads it: the head holds the first MIN(payload_len, 6) bytes,
+    // each block of the chain up to CANARD_BUFFER_BLOCK_DATA_SIZE more - receiving the last frame tops up the head or
+    // the last block - and whatever is left is read in place from the last frame through payload_tail.
+    const CanardBufferBlock* block = transfer->payload_middle;
+    const uint8_t* span = transfer->payload_head;
+    uint16_t span_start = 0;
+    uint16_t span_len = MIN(transfer->payload_len, CANARD_MULTIFRAME_RX_PAYLOAD_HEAD_SIZE);
+
+    while (len > 0) {
+        if (ofs < span_start+span_len) {
+            uint16_t copy_len = MIN(len, span_start+span_len-ofs);
+            memcpy(out, &span[ofs-span_start], copy_len);
+            out += copy_len;
+            ofs += copy_len;
+            len -= copy_len;
+        }
+
+        span_start += span_len;
+        if (block) {
+            span = block->data;
+            span_len = MIN((uint16_t)CANARD_BUFFER_BLOCK_DATA_SIZE, (uint16_t)(transfer->payload_len-span_start));
+            block = block->next;
+        } else if (transfer->payload_tail && span != transfer->payload_tail) {
+            span = transfer->payload_tail;
+            span_len = transfer->payload_len-span_start;
+        } else {
+            return;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+// crc64_we as built for one BOARD_CONFIG_CRC64_WE_TABLE_BITS setting against the original bitwise implementation:
+// the standard check value, then random buffers and seeds, whole and split into chained calls.
+
+#include <crc64_we.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CRC64_WE_CHECK_VALUE 0x62EC59E3F1A4F00AULL
+
+// the bootloader's crc64_we before the table driven versions
+static uint64_t reference_crc64_we(const uint8_t *buf, uint32_t len, uint64_t crc)
+{
+    uint32_t i;
+    uint8_t j;
+
+    crc = ~crc;
+
+    for (i = 0; i < len; i++) {
+        crc ^= ((uint64_t)buf[i]) << 56;
+        for (j = 0; j < 8; j++) {
+            crc = (crc & (1ULL<<63)) ? (crc<<1)^0x42F0E1EBA9EA3693ULL : (crc<<1);
+        }
+    }
+
+    return ~crc;
+}
+
+static uint64_t random_u64(void)
+{
+    return (uint64_t)rand() << 48 ^ (uint64_t)rand() << 24 ^ (uint64_t)rand();
+}
+
+int main(void)
+{
+    unsigned failures = 0;
+
+    const uint8_t check[] = "123456789";
+    uint64_t crc = crc64_we(check, 9, 0);
+    if (crc != CRC64_WE_CHECK_VALUE || reference_crc64_we(check, 9, 0) != CRC64_WE_CHECK_VALUE) {
+        printf("FAIL check value 0x%016llx\n", (unsigned long long)crc);
+        failures++;
+    }
+
+    static uint8_t buf[4096];
+    srand(1);
+    for (unsigned n=0; n<2000; n++) {
+        uint32_t len = n < 64 ? n : (uint32_t)rand() % sizeof(buf);
+        uint64_t seed = n % 2 ? random_u64() : 0;
+        for (uint32_t i=0; i<len; i++) {
+            buf[i] = (uint8_t)rand();
+        }
+
+        const uint64_t expected = reference_crc64_we(buf, len, seed);
+        const uint32_t split = len ? (uint32_t)rand() % len : 0;
+        const uint64_t whole = crc64_we(buf, len, seed);
+        const uint64_t chained = crc64_we(&buf[split], len-split, crc64_we(buf, split, seed));
+
+        if (whole != expected || chained != expected) {
+            printf("FAIL len %u seed 0x%016llx split %u: 0x%016llx / 0x%016llx, expected 0x%016llx\n", (unsigned)len,
+                (unsigned long long)seed, (unsigned)split, (unsigned long long)whole, (unsigned long long)chained, (unsigned long long)expected);
+            failures++;
+        }
+    }
+
+    if (failures != 0) {
+        printf("test_crc64_we (TABLE_BITS %d): %u failures\n", BOARD_CONFIG_CRC64_WE_TABLE_BITS, failures);
+        return 1;
+    }
+
+    printf("test_crc64_we (TABLE_BITS %d): ok\n", BOARD_CONFIG_CRC64_WE_TABLE_BITS);
+    return 0;
+}
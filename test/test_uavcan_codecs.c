@@ -0,0 +1,295 @@
+// The uavcan_codecs.h encoders and decoders against the DSDL bit stream as libcanard builds it: every reference
+// message is packed field by field with canardEncodeScalar, as the bootloader did before the codecs, and the decoders
+// must read back the values that went into it.
+
+#include <uavcan_codecs.h>
+#include <canard.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_ITERATIONS     2000
+#define TEST_BUF_SIZE       256
+
+static unsigned failures;
+
+static uint64_t random_u64(void)
+{
+    return (uint64_t)rand() << 48 ^ (uint64_t)rand() << 24 ^ (uint64_t)rand();
+}
+
+// random lowercase string of up to max_len chars
+static void random_string(char* str, uint16_t max_len)
+{
+    uint16_t len = (uint16_t)(rand() % (max_len+1));
+    for (uint16_t i=0; i<len; i++) {
+        str[i] = (char)('a' + rand()%26);
+    }
+    str[len] = '\0';
+}
+
+static void encode_bytes(uint8_t* buf, uint32_t bit_offset, const void* bytes, uint16_t len)
+{
+    for (uint16_t i=0; i<len; i++) {
+        canardEncodeScalar(buf, bit_offset+i*8U, 8, &((const uint8_t*)bytes)[i]);
+    }
+}
+
+static void check_buf(const char* what, const uint8_t* buf, uint16_t len, const uint8_t* expected, uint16_t expected_len)
+{
+    if (len != expected_len) {
+        printf("FAIL %s: length %u, expected %u\n", what, (unsigned)len, (unsigned)expected_len);
+        failures++;
+        return;
+    }
+
+    for (uint16_t i=0; i<len; i++) {
+        if (buf[i] != expected[i]) {
+            printf("FAIL %s: byte %u is 0x%02x, expected 0x%02x\n", what, (unsigned)i, buf[i], expected[i]);
+            failures++;
+            return;
+        }
+    }
+}
+
+static void check_value(const char* what, uint64_t value, uint64_t expected)
+{
+    if (value != expected) {
+        printf("FAIL %s: 0x%llx, expected 0x%llx\n", what, (unsigned long long)value, (unsigned long long)expected);
+        failures++;
+    }
+}
+
+static void test_node_status(uint8_t* node_status)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+
+    uint32_t uptime_sec = (uint32_t)random_u64();
+    uint8_t health = rand() % 4;
+    uint8_t mode = rand() % 8;
+    uint8_t sub_mode = rand() % 8;
+    uint16_t vendor_status = (uint16_t)rand();
+
+    canardEncodeScalar(expected, 0, 32, &uptime_sec);
+    canardEncodeScalar(expected, 32, 2, &health);
+    canardEncodeScalar(expected, 34, 3, &mode);
+    canardEncodeScalar(expected, 37, 3, &sub_mode);
+    canardEncodeScalar(expected, 40, 16, &vendor_status);
+
+    uavcan_encode_node_status(buf, uptime_sec, health, mode, sub_mode, vendor_status);
+    check_buf("NodeStatus", buf, UAVCAN_NODE_STATUS_SIZE, expected, 7);
+
+    memcpy(node_status, buf, UAVCAN_NODE_STATUS_SIZE);
+}
+
+static void test_get_node_info_response(const uint8_t* node_status)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+
+    uint8_t sw_major = (uint8_t)rand();
+    uint8_t sw_minor = (uint8_t)rand();
+    bool vcs_commit_available = rand() % 2;
+    uint32_t vcs_commit = (uint32_t)random_u64();
+    bool image_crc_available = rand() % 2;
+    uint64_t image_crc = random_u64();
+    uint8_t hw_major = (uint8_t)rand();
+    uint8_t hw_minor = (uint8_t)rand();
+    uint8_t unique_id[16];
+    for (uint8_t i=0; i<sizeof(unique_id); i++) {
+        unique_id[i] = (uint8_t)rand();
+    }
+    char name[UAVCAN_GET_NODE_INFO_NAME_MAX_LEN+20+1];
+    random_string(name, sizeof(name)-1);
+
+    uint8_t flags = (vcs_commit_available ? 1 : 0) | (image_crc_available ? 2 : 0);
+    uint8_t coa_len = 0;
+    uint16_t name_len = UAVCAN_CODEC_MIN(strlen(name), 80);
+
+    encode_bytes(expected, 0, node_status, 7);
+    canardEncodeScalar(expected, 56, 8, &sw_major);
+    canardEncodeScalar(expected, 64, 8, &sw_minor);
+    canardEncodeScalar(expected, 72, 8, &flags);
+    if (vcs_commit_available) {
+        canardEncodeScalar(expected, 80, 32, &vcs_commit);
+    }
+    if (image_crc_available) {
+        canardEncodeScalar(expected, 112, 64, &image_crc);
+    }
+    canardEncodeScalar(expected, 176, 8, &hw_major);
+    canardEncodeScalar(expected, 184, 8, &hw_minor);
+    encode_bytes(expected, 192, unique_id, 16);
+    canardEncodeScalar(expected, 320, 8, &coa_len);
+    encode_bytes(expected, 328, name, name_len);
+
+    uint16_t len = uavcan_encode_get_node_info_response(buf, node_status, sw_major, sw_minor, vcs_commit_available, vcs_commit,
+        image_crc_available, image_crc, hw_major, hw_minor, unique_id, name);
+    check_buf("GetNodeInfo response", buf, len, expected, 41+name_len);
+}
+
+static void test_get_transport_stats_response(void)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+    uint64_t fields[UAVCAN_GET_TRANSPORT_STATS_NUM_FIELDS];
+
+    for (uint8_t i=0; i<UAVCAN_GET_TRANSPORT_STATS_NUM_FIELDS; i++) {
+        fields[i] = random_u64() & 0xFFFFFFFFFFFFULL;
+        canardEncodeScalar(expected, i*48U, 48, &fields[i]);
+    }
+
+    uavcan_encode_get_transport_stats_response(buf, fields);
+    check_buf("GetTransportStats response", buf, UAVCAN_GET_TRANSPORT_STATS_SIZE, expected, 36);
+}
+
+static void test_restart_node(void)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+
+    uint64_t magic = random_u64() & 0xFFFFFFFFFFULL;
+    canardEncodeScalar(expected, 0, 40, &magic);
+    check_value("RestartNode request", uavcan_decode_restart_node_request(expected), magic);
+
+    bool ok = rand() % 2;
+    memset(expected, 0, sizeof(expected));
+    canardEncodeScalar(expected, 0, 1, &ok);
+    uavcan_encode_restart_node_response(buf, ok);
+    check_buf("RestartNode response", buf, UAVCAN_RESTART_NODE_RESPONSE_SIZE, expected, 1);
+}
+
+static void test_begin_firmware_update(void)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+
+    uint8_t source_node_id = (uint8_t)rand();
+    char path[UAVCAN_BEGIN_FIRMWARE_UPDATE_PATH_MAX_LEN+1];
+    random_string(path, UAVCAN_BEGIN_FIRMWARE_UPDATE_PATH_MAX_LEN);
+    canardEncodeScalar(expected, 0, 8, &source_node_id);
+    encode_bytes(expected, 8, path, strlen(path));
+
+    uint8_t decoded_source_node_id;
+    char decoded_path[UAVCAN_BEGIN_FIRMWARE_UPDATE_PATH_MAX_LEN+1];
+    uavcan_decode_begin_firmware_update_request(expected, 1+strlen(path), &decoded_source_node_id, decoded_path);
+    check_value("BeginFirmwareUpdate request source_node_id", decoded_source_node_id, source_node_id);
+    if (strcmp(decoded_path, path) != 0) {
+        printf("FAIL BeginFirmwareUpdate request path \"%s\", expected \"%s\"\n", decoded_path, path);
+        failures++;
+    }
+
+    uint8_t error = (uint8_t)rand();
+    char message[UAVCAN_BEGIN_FIRMWARE_UPDATE_MESSAGE_MAX_LEN+20+1];
+    random_string(message, sizeof(message)-1);
+    uint16_t message_len = UAVCAN_CODEC_MIN(strlen(message), 127);
+    memset(expected, 0, sizeof(expected));
+    canardEncodeScalar(expected, 0, 8, &error);
+    encode_bytes(expected, 8, message, message_len);
+
+    uint16_t len = uavcan_encode_begin_firmware_update_response(buf, error, message);
+    check_buf("BeginFirmwareUpdate response", buf, len, expected, 1+message_len);
+}
+
+static void test_file_read(void)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+
+    uint64_t offset = random_u64() & 0xFFFFFFFFFFULL;
+    char path[UAVCAN_FILE_READ_PATH_MAX_LEN+1];
+    random_string(path, UAVCAN_FILE_READ_PATH_MAX_LEN);
+    canardEncodeScalar(expected, 0, 40, &offset);
+    encode_bytes(expected, 40, path, strlen(path));
+
+    uint16_t len = uavcan_encode_file_read_request(buf, offset, path);
+    check_buf("file.Read request", buf, len, expected, 5+strlen(path));
+
+    int16_t error = (int16_t)rand();
+    memset(expected, 0, sizeof(expected));
+    canardEncodeScalar(expected, 0, 16, &error);
+    check_value("file.Read response error", (uint16_t)uavcan_decode_file_read_response_error(expected), (uint16_t)error);
+}
+
+static void test_allocation(void)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+
+    uint8_t node_id = rand() % 128;
+    bool first_part_of_unique_id = rand() % 2;
+    uint8_t unique_id_part[16];
+    uint8_t unique_id_len = rand() % (sizeof(unique_id_part)+1);
+    for (uint8_t i=0; i<unique_id_len; i++) {
+        unique_id_part[i] = (uint8_t)rand();
+    }
+    canardEncodeScalar(expected, 0, 7, &node_id);
+    canardEncodeScalar(expected, 7, 1, &first_part_of_unique_id);
+    encode_bytes(expected, 8, unique_id_part, unique_id_len);
+
+    uint16_t len = uavcan_encode_allocation_request(buf, node_id, first_part_of_unique_id, unique_id_part, unique_id_len);
+    check_buf("Allocation request", buf, len, expected, 1+unique_id_len);
+    check_value("Allocation node_id", uavcan_decode_allocation_node_id(expected), node_id);
+}
+
+static void test_key_value(void)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+
+    float value = (float)rand() / 1000.0f - 1000.0f;
+    char name[UAVCAN_KEY_VALUE_NAME_MAX_LEN+1];
+    random_string(name, UAVCAN_KEY_VALUE_NAME_MAX_LEN);
+    canardEncodeScalar(expected, 0, 32, &value);
+    encode_bytes(expected, 32, name, strlen(name));
+
+    uint16_t len = uavcan_encode_key_value(buf, value, name);
+    check_buf("KeyValue", buf, len, expected, 4+strlen(name));
+}
+
+static void test_log_message(void)
+{
+    uint8_t buf[TEST_BUF_SIZE] = {0};
+    uint8_t expected[TEST_BUF_SIZE] = {0};
+
+    uint8_t level = rand() % 8;
+    char source[UAVCAN_LOG_MESSAGE_SOURCE_MAX_LEN+10+1];
+    random_string(source, sizeof(source)-1);
+    char text[UAVCAN_LOG_MESSAGE_TEXT_MAX_LEN+20+1];
+    random_string(text, sizeof(text)-1);
+
+    uint8_t source_len = UAVCAN_CODEC_MIN(strlen(source), 31);
+    uint16_t text_len = UAVCAN_CODEC_MIN(strlen(text), 90);
+    canardEncodeScalar(expected, 0, 3, &level);
+    canardEncodeScalar(expected, 3, 5, &source_len);
+    encode_bytes(expected, 8, source, source_len);
+    encode_bytes(expected, 8+source_len*8U, text, text_len);
+
+    uint16_t len = uavcan_encode_log_message(buf, level, source, text);
+    check_buf("LogMessage", buf, len, expected, 1+source_len+text_len);
+}
+
+int main(void)
+{
+    srand(1);
+
+    for (unsigned n=0; n<TEST_ITERATIONS; n++) {
+        uint8_t node_status[UAVCAN_NODE_STATUS_SIZE];
+        test_node_status(node_status);
+        test_get_node_info_response(node_status);
+        test_get_transport_stats_response();
+        test_restart_node();
+        test_begin_firmware_update();
+        test_file_read();
+        test_allocation();
+        test_key_value();
+        test_log_message();
+    }
+
+    if (failures != 0) {
+        printf("test_uavcan_codecs: %u failures\n", failures);
+        return 1;
+    }
+
+    printf("test_uavcan_codecs: ok\n");
+    return 0;
+}
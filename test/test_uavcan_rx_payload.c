@@ -0,0 +1,116 @@
+// uavcan_rx_payload_copy against libcanard's own reassembly: every transfer is queued by a TX instance, its frames are
+// fed to an RX instance, and each span read out of the received transfer is compared with the payload that was sent
+// and with canardDecodeScalar reading the same bytes.
+
+#include <uavcan.h>
+#include <canard.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_DATA_TYPE_ID           20000
+#define TEST_DATA_TYPE_SIGNATURE    0x0123456789abcdefULL
+#define TEST_MAX_PAYLOAD_LEN        300
+
+static uint8_t sent_payload[TEST_MAX_PAYLOAD_LEN];
+static uint16_t sent_payload_len;
+static unsigned received_transfers;
+static unsigned failures;
+
+static bool should_accept(const CanardInstance* ins, uint64_t* out_data_type_signature, uint16_t data_type_id, CanardTransferType transfer_type, uint8_t source_node_id)
+{
+    (void)ins;
+    (void)source_node_id;
+    if (transfer_type != CanardTransferTypeBroadcast || data_type_id != TEST_DATA_TYPE_ID) {
+        return false;
+    }
+    *out_data_type_signature = TEST_DATA_TYPE_SIGNATURE;
+    return true;
+}
+
+static void check_span(CanardRxTransfer* transfer, uint16_t ofs, uint16_t len)
+{
+    uint8_t buf[TEST_MAX_PAYLOAD_LEN];
+    memset(buf, 0xAA, sizeof(buf));
+
+    const struct uavcan_rx_payload_s payload = { transfer, ofs };
+    uavcan_rx_payload_copy(&payload, buf, len);
+
+    for (uint16_t i=0; i<len; i++) {
+        uint8_t decoded = 0;
+        canardDecodeScalar(transfer, (uint32_t)(ofs+i)*8U, 8, false, &decoded);
+
+        if (buf[i] != sent_payload[ofs+i] || buf[i] != decoded) {
+            printf("FAIL payload_len %u ofs %u len %u: byte %u is 0x%02x, sent 0x%02x, canard 0x%02x\n",
+                (unsigned)sent_payload_len, (unsigned)ofs, (unsigned)len, (unsigned)(ofs+i), buf[i], sent_payload[ofs+i], decoded);
+            failures++;
+            return;
+        }
+    }
+}
+
+static void on_transfer_received(CanardInstance* ins, CanardRxTransfer* transfer)
+{
+    received_transfers++;
+
+    if (transfer->payload_len != sent_payload_len) {
+        printf("FAIL payload_len %u received as %u\n", (unsigned)sent_payload_len, (unsigned)transfer->payload_len);
+        failures++;
+    } else {
+        for (uint16_t ofs=0; ofs<sent_payload_len; ofs++) {
+            // the whole remainder, and short reads that end on every byte
+            check_span(transfer, ofs, sent_payload_len-ofs);
+            check_span(transfer, ofs, 1);
+            if (ofs+3 <= sent_payload_len) {
+                check_span(transfer, ofs, 3);
+            }
+        }
+    }
+
+    canardReleaseRxTransferPayload(ins, transfer);
+}
+
+int main(void)
+{
+    static uint8_t tx_pool[16384];
+    static uint8_t rx_pool[4096];
+    CanardInstance tx, rx;
+
+    canardInit(&tx, tx_pool, sizeof(tx_pool), NULL, NULL, NULL);
+    canardSetLocalNodeID(&tx, 10);
+    canardInit(&rx, rx_pool, sizeof(rx_pool), on_transfer_received, should_accept, NULL);
+    canardSetLocalNodeID(&rx, 20);
+
+    srand(1);
+    uint8_t transfer_id = 0;
+    uint64_t timestamp_usec = 1000;
+
+    for (sent_payload_len=1; sent_payload_len<=TEST_MAX_PAYLOAD_LEN; sent_payload_len++) {
+        for (uint16_t i=0; i<sent_payload_len; i++) {
+            sent_payload[i] = (uint8_t)rand();
+        }
+
+        unsigned expected_transfers = received_transfers+1;
+        canardBroadcast(&tx, TEST_DATA_TYPE_SIGNATURE, TEST_DATA_TYPE_ID, &transfer_id, CANARD_TRANSFER_PRIORITY_LOW, sent_payload, sent_payload_len);
+
+        for (const CanardCANFrame* frame = canardPeekTxQueue(&tx); frame != NULL; frame = canardPeekTxQueue(&tx)) {
+            canardHandleRxFrame(&rx, frame, timestamp_usec);
+            timestamp_usec += 100;
+            canardPopTxQueue(&tx);
+        }
+
+        if (received_transfers != expected_transfers) {
+            printf("FAIL payload_len %u was not received\n", (unsigned)sent_payload_len);
+            failures++;
+            received_transfers = expected_transfers;
+        }
+    }
+
+    if (failures != 0) {
+        printf("test_uavcan_rx_payload: %u failures\n", failures);
+        return 1;
+    }
+
+    printf("test_uavcan_rx_payload: ok, payload lengths 1-%u\n", TEST_MAX_PAYLOAD_LEN);
+    return 0;
+}
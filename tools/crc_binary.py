@@ -3,9 +3,60 @@ import sys
 import os
 import binascii
 import struct
+import zlib
 
 app_descriptor_fmt = "<8cQI"
+APP_DESCRIPTOR_OFS_LOCATION = 0x1C
 SHARED_APP_DESCRIPTOR_SIGNATURES = ["\xd7\xe4\xf7\xba\xd0\x0f\x9b\xee", "\x40\xa2\xe4\xf1\x64\x68\x91\x06"]
+delta_manifest_fmt = "<IHHI"
+DELTA_MANIFEST_MAGIC = 0x50444D4F
+DELTA_MANIFEST_SUFFIX = ".pages"
+APP_PAGE_SIZE = 2048
+compressed_image_fmt = "<II"
+COMPRESSED_IMAGE_MAGIC = 0x5A444D4F
+LZSS_WINDOW_SIZE = 1024
+LZSS_MIN_MATCH = 3
+LZSS_MAX_MATCH = 18
+LZSS_MAX_CANDIDATES = 64
+
+# greedy LZSS matching the bootloader's decoder in src/lzss.c
+def lzss_compress(data):
+    data = bytearray(data)
+    out = bytearray()
+    chains = {}
+    i = 0
+    while i < len(data):
+        flags_idx = len(out)
+        out.append(0)
+        for bit in range(8):
+            if i >= len(data):
+                break
+
+            best_len, best_dist = 0, 0
+            for j in reversed(chains.get(bytes(data[i:i+LZSS_MIN_MATCH]), [])[-LZSS_MAX_CANDIDATES:]):
+                if i - j > LZSS_WINDOW_SIZE:
+                    break
+                l = 0
+                while l < LZSS_MAX_MATCH and i+l < len(data) and data[j+l] == data[i+l]:
+                    l += 1
+                if l > best_len:
+                    best_len, best_dist = l, i-j
+                    if l == LZSS_MAX_MATCH:
+                        break
+
+            if best_len >= LZSS_MIN_MATCH:
+                out.append((best_dist-1) & 0xff)
+                out.append((((best_dist-1) >> 8) << 4) | (best_len-LZSS_MIN_MATCH))
+                n = best_len
+            else:
+                out[flags_idx] |= 1 << bit
+                out.append(data[i])
+                n = 1
+
+            for k in range(i, i+n):
+                chains.setdefault(bytes(data[k:k+LZSS_MIN_MATCH]), []).append(k)
+            i += n
+    return bytes(out)
 
 crc64 = crcmod.predefined.Crc('crc-64-we')
 
@@ -19,6 +70,10 @@ for i in range(0, len(data), 8):
         app_descriptor_idx = i
         break
 
+# record the descriptor offset in a reserved vector table entry, the bootloader then does not have to search for it
+if data[APP_DESCRIPTOR_OFS_LOCATION:APP_DESCRIPTOR_OFS_LOCATION+4] == b"\x00\x00\x00\x00":
+    data = data[:APP_DESCRIPTOR_OFS_LOCATION] + struct.pack("<I", app_descriptor_idx) + data[APP_DESCRIPTOR_OFS_LOCATION+4:]
+
 app_descriptor = data[app_descriptor_idx:app_descriptor_idx+app_descriptor_len]
 
 fields = list(struct.unpack(app_descriptor_fmt, app_descriptor))
@@ -41,3 +96,17 @@ app_descriptor = data[app_descriptor_idx:app_descriptor_idx+app_descriptor_len]
 
 with open(sys.argv[2], 'wb') as f:
     f.write(data)
+
+# per-page crc32 manifest used by the bootloader for delta updates
+pages = [data[i:i+APP_PAGE_SIZE] for i in range(0, len(data), APP_PAGE_SIZE)]
+manifest = struct.pack(delta_manifest_fmt, DELTA_MANIFEST_MAGIC, APP_PAGE_SIZE, len(pages), len(data))
+for page in pages:
+    manifest += struct.pack("<I", zlib.crc32(page) & 0xffffffff)
+
+with open(sys.argv[2] + DELTA_MANIFEST_SUFFIX, 'wb') as f:
+    f.write(manifest)
+
+# optional compressed copy of the image, decompressed by the bootloader while it is downloaded
+if len(sys.argv) > 3:
+    with open(sys.argv[3], 'wb') as f:
+        f.write(struct.pack(compressed_image_fmt, COMPRESSED_IMAGE_MAGIC, len(data)) + lzss_compress(data))